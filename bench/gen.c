@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// генератор синтетических скриптов MovDino для замеров;
+// одинаковые аргументы и seed всегда дают одинаковые файлы
+
+#define SIDE 100     // поле 100x100
+#define BIG_SIDE 100000 // поле для нагрузки big
+#define EXEC_DEPTH 9 // вложенность EXEC: основной файл + 9 уровней не превышают предел 10
+
+unsigned long long rng_state;
+
+unsigned rng(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(rng_state >> 33);
+}
+
+const char *dirs[] = {"UP", "DOWN", "LEFT", "RIGHT"};
+
+FILE *open_out(const char *dir, const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    if (!f) printf("Error: cannot open '%s'\n", path);
+    return f;
+}
+
+void header(FILE *f) {
+    fprintf(f, "SIZE %d %d\nSTART %d %d\n", SIDE, SIDE, SIDE / 2, SIDE / 2);
+}
+
+// поле пустое, поэтому MOVE никогда не упирается в препятствия
+void gen_move(FILE *f, long n) {
+    header(f);
+    for (long i = 0; i < n; i++) fprintf(f, "MOVE %s\n", dirs[rng() % 4]);
+}
+
+void gen_paint(FILE *f, long n) {
+    header(f);
+    for (long i = 0; i < n; i++) {
+        if (i % 4 == 3) fprintf(f, "MOVE %s\n", dirs[rng() % 4]);
+        else fprintf(f, "PAINT %c\n", 'a' + rng() % 26);
+    }
+}
+
+void gen_jump(FILE *f, long n) {
+    header(f);
+    for (long i = 0; i < n; i++) fprintf(f, "JUMP %s %u\n", dirs[rng() % 4], 1000000000u + rng() % 1000000000u);
+}
+
+// цепочка level1.txt -> ... -> level9.txt, каждый уровень: 2 MOVE и EXEC следующего (+ сам EXEC)
+int gen_exec(FILE *f, long n, const char *dir) {
+    for (int k = 1; k <= EXEC_DEPTH; k++) {
+        char name[32]; snprintf(name, sizeof(name), "level%d.txt", k);
+        FILE *lf = open_out(dir, name);
+        if (!lf) return 1;
+        fprintf(lf, "MOVE %s\n", dirs[rng() % 4]);
+        if (k < EXEC_DEPTH) fprintf(lf, "EXEC level%d.txt\n", k + 1);
+        fprintf(lf, "PAINT %c\n", 'a' + rng() % 26);
+        fclose(lf);
+    }
+    header(f);
+    long per_call = 3L * EXEC_DEPTH - 1; // команд на один EXEC верхнего уровня
+    for (long i = 0; i < n; i += per_call) fprintf(f, "EXEC level1.txt\n");
+    return 0;
+}
+
+void gen_undo(FILE *f, long n) {
+    header(f);
+    for (long i = 0; i < n; i++) {
+        switch (rng() % 4) {
+        case 0: fprintf(f, "MOVE %s\n", dirs[rng() % 4]); break;
+        case 1: fprintf(f, "PAINT %c\n", 'a' + rng() % 26); break;
+        default: fprintf(f, "UNDO\n"); break;
+        }
+    }
+}
+
+// поле со случайными объектами и красками; скрипт только красит, не двигаясь
+int gen_load(FILE *f, long n, const char *dir) {
+    FILE *ff = open_out(dir, "field.txt");
+    if (!ff) return 1;
+    const char objs[] = "____________^&@%";
+    for (int i = 0; i < SIDE; i++) {
+        for (int j = 0; j < SIDE; j++) {
+            char c = (i == SIDE / 2 && j == SIDE / 2) ? '#' : (rng() % 5 == 0 ? (char)('a' + rng() % 26) : objs[rng() % 16]);
+            fprintf(ff, "%c ", c);
+        }
+        fprintf(ff, "\n");
+    }
+    fclose(ff);
+    fprintf(f, "SIZE %d %d\nLOAD field.txt\n", SIDE, SIDE);
+    for (long i = 0; i < n; i++) fprintf(f, "PAINT %c\n", 'a' + rng() % 26);
+    return 0;
+}
+
+// большое поле: блуждание с покраской, горами и прыжками; затрагивает малую часть тайлов
+void gen_big(FILE *f, long n) {
+    fprintf(f, "SIZE %d %d\nSTART %d %d\n", BIG_SIDE, BIG_SIDE, BIG_SIDE / 2, BIG_SIDE / 2);
+    for (long i = 0; i < n; i++) {
+        switch (rng() % 8) {
+        case 0: fprintf(f, "PAINT %c\n", 'a' + rng() % 26); break;
+        case 1: fprintf(f, "MOUND %s\n", dirs[rng() % 4]); break;
+        case 2: fprintf(f, "JUMP %s %u\n", dirs[rng() % 4], 1 + rng() % 1000); break;
+        default: fprintf(f, "MOVE %s\n", dirs[rng() % 4]); break;
+        }
+    }
+}
+
+// блоки REPEAT с сериями MOVE и покраской; n — сколько команд выполнится
+void gen_repeat(FILE *f, long n) {
+    header(f);
+    for (long done = 0; done < n; ) {
+        int times = 1 + rng() % 50, run = 1 + rng() % 20;
+        const char *dir = dirs[rng() % 4];
+        fprintf(f, "REPEAT %d\n", times);
+        for (int k = 0; k < run; k++) fprintf(f, "MOVE %s\n", dir);
+        fprintf(f, "PAINT %c\nEND\n", 'a' + rng() % 26);
+        done += 1 + (long)times * (run + 1);
+    }
+}
+
+const char *workloads[] = {"move", "paint", "jump", "exec", "undo", "load", "big", "repeat"};
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <move|paint|jump|exec|undo|load|big|repeat|all> <commands> <out_dir> [seed]\n", argv[0]);
+        return 1;
+    }
+    long n = atol(argv[2]);
+    const char *dir = argv[3];
+    unsigned long long seed = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+    int all = strcmp(argv[1], "all") == 0, found = 0;
+
+    for (size_t k = 0; k < sizeof(workloads) / sizeof(workloads[0]); k++) {
+        if (!all && strcmp(argv[1], workloads[k]) != 0) continue;
+        found = 1;
+        rng_state = seed;
+        char name[32]; snprintf(name, sizeof(name), "%s.txt", workloads[k]);
+        FILE *f = open_out(dir, name);
+        if (!f) return 1;
+        int rc = 0;
+        switch (k) {
+        case 0: gen_move(f, n); break;
+        case 1: gen_paint(f, n); break;
+        case 2: gen_jump(f, n); break;
+        case 3: rc = gen_exec(f, n, dir); break;
+        case 4: gen_undo(f, n); break;
+        case 5: rc = gen_load(f, n, dir); break;
+        case 6: gen_big(f, n); break;
+        case 7: gen_repeat(f, n); break;
+        }
+        fclose(f);
+        if (rc) return rc;
+    }
+    if (!found) { printf("Error: unknown workload '%s'\n", argv[1]); return 1; }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# замеры интерпретатора на синтетических нагрузках
+# использование: bench/run.sh [команд_в_скрипте] [seed]
+set -e
+N=${1:-200000}
+SEED=${2:-1}
+CC=${CC:-gcc}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK="$ROOT/bench/work"
+
+mkdir -p "$WORK"
+$CC -O2 -o "$WORK/movdino" "$ROOT/main.c" -pthread
+$CC -O2 -o "$WORK/gen" "$ROOT/bench/gen.c"
+cd "$WORK"
+./gen all "$N" . "$SEED"
+
+# значение поля name=... из строки bench:
+field() {
+    echo "$2" | sed -n "s/.* $1=\([^ ]*\).*/\1/p"
+}
+
+printf "%-8s %10s %10s %14s %12s %12s %10s\n" workload commands parse_ms cmds/sec peak_rss_kb hist_B/cmd write_ms
+status=0
+for w in move paint jump exec undo load big repeat; do
+    # текстом поле 100000x100000 заняло бы 20 ГБ
+    fmt=; [ "$w" = big ] && fmt=binary
+    line=$(./movdino "$w.txt" "$w.out" no-display bench $fmt | grep '^bench:') || { echo "$w: failed"; status=1; continue; }
+    printf "%-8s %10s %10s %14s %12s %12s %10s\n" "$w" \
+        "$(field commands "$line")" "$(field parse_ms "$line")" "$(field cmds_per_sec "$line")" \
+        "$(field peak_rss_kb "$line")" "$(field history_bytes_per_cmd "$line")" "$(field write_ms "$line")"
+done
+exit $status
@@ -1,547 +1,3086 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+
+#include <stdatomic.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// клетка поля: объект и цвет (0 если не окрашена)
+typedef struct {
+    char terrain;
+    char paint;
+} Cell;
+
+// отсортированный набор координат; v выделяется из арены индекса поля (IntBlock)
+typedef struct {
+    int *v; int size, cap;
+} IntSet;
+
+// поле из квадратных тайлов TILE_SIZE×TILE_SIZE: тайл выделяется при первой записи непустой клетки,
+// до этого все его клетки пустые, поэтому большое поле занимает память только там, где его меняли;
+// для JUMP и серий MOVE по каждой строке и каждому столбцу хранятся координаты препятствий (^ & @) и ям
+#define TILE_SHIFT 5
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+#define MAX_SIZE 100000 // наибольшая сторона поля
+#define ARENA_FIRST 4    // тайлов в первом блоке арены, дальше блоки удваиваются
+#define ARENA_MAX 256    // наибольший блок арены (в тайлах)
+#define INDEX_BLOCK 16384 // int в блоке арены индекса препятствий и ям
+
+// блок арены тайлов: тайлы раздаются подряд и освобождаются только вместе с полем
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    int cap, used; // тайлов в блоке и сколько роздано
+    Cell cells[];
+} ArenaBlock;
+
+// блок арены индекса: массивы IntSet раздаются подряд; при росте набор копируется в новый массив,
+// старый остается в блоке до освобождения поля
+typedef struct IntBlock {
+    struct IntBlock *next;
+    int cap, used; // int в блоке и сколько роздано
+    int v[];
+} IntBlock;
+
+// измененная клетка текущего шага для trace
+typedef struct {
+    int x, y;
+    Cell c;
+} TraceCell;
+
+// режим trace: поток записей о каждом шаге; изменения клеток копятся до конца шага
+typedef struct {
+    FILE *f;
+    unsigned char *buf; size_t size; // буфер записи TRACE_BUF байт
+    TraceCell *cells; int ncells, ccap;
+    int px, py;      // позиция динозавра в прошлой записи
+    int nfiles;      // сколько имен файлов записано
+    long long steps;
+    bool failed;     // не хватило памяти или ошибка записи
+} Trace;
+
+// клетка записи memo: сдвиг от позиции динозавра в начале EXEC и значение
+typedef struct {
+    int dx, dy;
+    Cell c;
+} MemoCell;
+
+// режим memo: результат одного вызова EXEC — какие клетки он прочитал (значения до вызова),
+// что записал и куда сдвинул динозавра. Вызов с теми же значениями прочитанных клеток делает то же самое
+typedef struct {
+    int sx, sy;          // позиция динозавра в начале вызова
+    bool absolute;       // было IF CELL (клетка по абсолютным координатам): запись годится только для той же позиции
+    bool failed;         // был JUMP: он смотрит индекс препятствий, а не отдельные клетки, запись не сохраняется
+    int dx, dy;          // сдвиг динозавра за вызов
+    long long executed;  // сколько команд выполнил вызов
+    int depth;           // наибольшая глубина вложенного EXEC относительно вызова: повтор глубже предела не годится
+    MemoCell *reads; int nreads, rcap;
+    MemoCell *writes; int nwrites, wcap;
+    long long *keys; int *ridx, *widx; int ksize, kcount; // при записи: клетка → номер в reads и writes
+} Memo;
+
+typedef struct {
+    int width, height;
+    int tiles_x, tiles_y;
+    Cell **tiles;     // tiles_x * tiles_y, по строкам тайлов; NULL — тайл не тронут
+    long long used;   // сколько тайлов выделено
+    ArenaBlock *arena; // блоки, из которых выделены тайлы; последний выделенный — первый
+    IntBlock *index_arena; // блоки для row_obst, col_obst, row_pit, col_pit; текущий — первый
+    bool oom;         // тайл или запись индекса препятствий не выделились, изменение клетки потеряно
+    Trace *trace;     // режим trace: сюда попадают все изменения клеток
+    Memo *rec;        // режим memo: вызов EXEC, для которого записываются чтения и записи клеток
+    IntSet *row_obst; // row_obst[y] — столбцы x препятствий в строке y
+    IntSet *col_obst; // col_obst[x] — строки y препятствий в столбце x
+    IntSet *row_pit, *col_pit; // то же для ям
+} Grid;
+
+// сообщения об ошибках и предупреждения: сразу в stdout или в буфер задания (пакетный режим)
+typedef struct {
+    bool buffered;
+    char *buf; size_t size, cap;
+    int count; // сколько сообщений написано
+} Log;
+
+// одно изменение клетки: тайл, клетка внутри тайла и старое значение
+typedef struct {
+    int tile;
+    unsigned short off;
+    Cell old;
+} CellChange;
+
+// шаг истории: с какого изменения начался и где стоял динозавр
+typedef struct {
+    int start;
+    int x, y;
+} Step;
+
+// журнал изменений для UNDO
+typedef struct {
+    CellChange *changes; int csize, ccap;
+    Step *steps; int ssize, scap;
+    bool off;  // UNDO в скрипте не встречается, история не пишется
+    int limit; // хранить только последние limit шагов, 0 — все
+} History;
+
+void log_msg(Log *log, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log->count++;
+    if (!log->buffered) { vprintf(fmt, ap); va_end(ap); return; }
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && log->size + n + 1 > log->cap) {
+        size_t ncap = log->cap ? log->cap * 2 : 256;
+        while (ncap < log->size + n + 1) ncap *= 2;
+        char *nb = realloc(log->buf, ncap);
+        if (!nb) n = -1;
+        else { log->buf = nb; log->cap = ncap; }
+    }
+    if (n >= 0) { vsnprintf(log->buf + log->size, n + 1, fmt, ap2); log->size += n; }
+    va_end(ap2);
+}
+
+void log_free(Log *log) {
+    free(log->buf);
+    memset(log, 0, sizeof(*log));
+}
+
+// тороидальное поле: координата по модулю размера
+int wrap(int v, int n) {
+    v %= n;
+    return v < 0 ? v + n : v;
+}
+
+// перемешивание битов для хэш-таблиц (splitmix64)
+unsigned long long mix64(unsigned long long v) {
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
+}
+
+// клетка нетронутого тайла
+const Cell empty_cell = { '_', '\0' };
+
+int tile_index(Grid *g, int x, int y) {
+    return (y >> TILE_SHIFT) * g->tiles_x + (x >> TILE_SHIFT);
+}
+
+int tile_offset(int x, int y) {
+    return (y & TILE_MASK) << TILE_SHIFT | (x & TILE_MASK);
+}
+
+// отмечает клетку в записи memo: первое чтение запоминает значение до вызова (если вызов
+// ее еще не менял), запись — итоговое значение. false — не хватило памяти, запись не сохранится
+bool memo_note(Grid *g, int x, int y, Cell c, bool write) {
+    Memo *m = g->rec;
+    int rx = wrap(x - m->sx, g->width), ry = wrap(y - m->sy, g->height);
+    long long key = (long long)ry * g->width + rx;
+    if ((m->kcount + 1) * 2 > m->ksize) {
+        int nsize = m->ksize ? m->ksize * 2 : 64;
+        long long *nk = malloc(nsize * sizeof(long long));
+        int *nr = malloc(nsize * sizeof(int)), *nw = malloc(nsize * sizeof(int));
+        if (!nk || !nr || !nw) { free(nk); free(nr); free(nw); m->failed = true; return false; }
+        for (int i = 0; i < nsize; i++) nk[i] = -1;
+        for (int i = 0; i < m->ksize; i++) {
+            if (m->keys[i] < 0) continue;
+            int h = (int)(mix64(m->keys[i]) & (nsize - 1));
+            while (nk[h] >= 0) h = (h + 1) & (nsize - 1);
+            nk[h] = m->keys[i]; nr[h] = m->ridx[i]; nw[h] = m->widx[i];
+        }
+        free(m->keys); free(m->ridx); free(m->widx);
+        m->keys = nk; m->ridx = nr; m->widx = nw; m->ksize = nsize;
+    }
+    int h = (int)(mix64(key) & (m->ksize - 1));
+    while (m->keys[h] >= 0 && m->keys[h] != key) h = (h + 1) & (m->ksize - 1);
+    if (m->keys[h] < 0) { m->keys[h] = key; m->ridx[h] = m->widx[h] = -1; m->kcount++; }
+    MemoCell **v = write ? &m->writes : &m->reads;
+    int *n = write ? &m->nwrites : &m->nreads, *cap = write ? &m->wcap : &m->rcap;
+    int *idx = write ? &m->widx[h] : &m->ridx[h];
+    if (write && *idx >= 0) { (*v)[*idx].c = c; return true; }
+    if (!write && (m->ridx[h] >= 0 || m->widx[h] >= 0)) return true;
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 16;
+        MemoCell *nv = realloc(*v, ncap * sizeof(MemoCell));
+        if (!nv) { m->failed = true; return false; }
+        *v = nv; *cap = ncap;
+    }
+    (*v)[*n].dx = rx; (*v)[*n].dy = ry; (*v)[*n].c = c;
+    *idx = (*n)++;
+    return true;
+}
+
+void memo_free(Memo *m) {
+    free(m->reads); free(m->writes); free(m->keys); free(m->ridx); free(m->widx);
+}
+
+// только для чтения: менять клетки можно лишь через grid_put
+const Cell *grid_at(Grid *g, int x, int y) {
+    Cell *t = g->tiles[tile_index(g, x, y)];
+    const Cell *c = t ? &t[tile_offset(x, y)] : &empty_cell;
+    if (g->rec) memo_note(g, x, y, *c, false);
+    return c;
+}
+
+const Cell *grid_at_wrap(Grid *g, int x, int y) {
+    return grid_at(g, wrap(x, g->width), wrap(y, g->height));
+}
+
+// как клетка выглядит на экране (без динозавра)
+char cell_symbol(const Cell *c) {
+    return (c->terrain == '_' && c->paint != '\0') ? c->paint : c->terrain;
+}
+
+// первый индекс с v[i] >= key
+int intset_lower(IntSet *set, int key) {
+    int lo = 0, hi = set->size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (set->v[mid] < key) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// n подряд идущих int из арены индекса поля, NULL — нет памяти
+int *arena_ints(Grid *g, int n) {
+    IntBlock *b = g->index_arena;
+    if (b && b->cap - b->used >= n) { b->used += n; return b->v + b->used - n; }
+    int cap = n > INDEX_BLOCK ? n : INDEX_BLOCK;
+    IntBlock *nb = malloc(sizeof(IntBlock) + (size_t)cap * sizeof(int));
+    if (!nb) return NULL;
+    nb->cap = cap; nb->used = n;
+    // большой набор получает свой блок за текущим, место в текущем не теряется
+    if (b && n > INDEX_BLOCK / 2) { nb->next = b->next; b->next = nb; }
+    else { nb->next = b; g->index_arena = nb; }
+    return nb->v;
+}
+
+bool intset_add(Grid *g, IntSet *set, int key) {
+    int i = intset_lower(set, key);
+    if (i < set->size && set->v[i] == key) return true;
+    if (set->size == set->cap) {
+        int ncap = set->cap ? set->cap * 2 : 4;
+        int *nv = arena_ints(g, ncap);
+        if (!nv) return false;
+        if (set->size > 0) memcpy(nv, set->v, set->size * sizeof(int));
+        set->v = nv; set->cap = ncap;
+    }
+    memmove(set->v + i + 1, set->v + i, (set->size - i) * sizeof(int));
+    set->v[i] = key;
+    set->size++;
+    return true;
+}
+
+void intset_remove(IntSet *set, int key) {
+    int i = intset_lower(set, key);
+    if (i == set->size || set->v[i] != key) return;
+    memmove(set->v + i, set->v + i + 1, (set->size - i - 1) * sizeof(int));
+    set->size--;
+}
+
+bool is_obstacle(char t) {
+    return t == '^' || t == '&' || t == '@';
+}
+
+bool is_empty_cell(Cell c) {
+    return c.terrain == '_' && c.paint == '\0';
+}
+
+void trace_cell(Trace *t, int x, int y, Cell c) {
+    if (t->ncells == t->ccap) {
+        int ncap = t->ccap ? t->ccap * 2 : 16;
+        TraceCell *nc = realloc(t->cells, ncap * sizeof(TraceCell));
+        if (!nc) { t->failed = true; return; }
+        t->cells = nc; t->ccap = ncap;
+    }
+    TraceCell *tc = &t->cells[t->ncells++];
+    tc->x = x; tc->y = y; tc->c = c;
+}
+
+// новый тайл из арены поля; блоки растут вдвое, чтобы маленькое поле не занимало лишнего,
+// а на большом malloc вызывался редко. NULL — памяти нет
+Cell *arena_tile(Grid *g) {
+    ArenaBlock *b = g->arena;
+    if (!b || b->used == b->cap) {
+        int cap = b ? (b->cap * 2 < ARENA_MAX ? b->cap * 2 : ARENA_MAX) : ARENA_FIRST;
+        b = malloc(sizeof(ArenaBlock) + (size_t)cap * TILE_SIZE * TILE_SIZE * sizeof(Cell));
+        if (!b) return NULL;
+        b->next = g->arena; b->cap = cap; b->used = 0;
+        g->arena = b;
+    }
+    return b->cells + (size_t)b->used++ * TILE_SIZE * TILE_SIZE;
+}
+
+// все изменения клеток проходят здесь, чтобы индекс препятствий не расходился с полем;
+// если памяти на новый тайл или на индекс препятствий и ям нет, ставит g->oom
+void grid_put(Grid *g, int x, int y, Cell c) {
+    if (g->rec) memo_note(g, x, y, c, true);
+    Cell **slot = &g->tiles[tile_index(g, x, y)];
+    if (!*slot) {
+        if (is_empty_cell(c)) return; // тайл и так пустой
+        *slot = arena_tile(g);
+        if (!*slot) { g->oom = true; return; }
+        for (int i = 0; i < TILE_SIZE * TILE_SIZE; i++) (*slot)[i] = empty_cell;
+        g->used++;
+    }
+    Cell *cell = &(*slot)[tile_offset(x, y)];
+    bool was = is_obstacle(cell->terrain), now = is_obstacle(c.terrain);
+    bool was_pit = cell->terrain == '%', now_pit = c.terrain == '%';
+    *cell = c;
+    if (g->trace) trace_cell(g->trace, x, y, c);
+    if (was != now) {
+        // индекс без новой клетки дал бы неверные JUMP и PUSH: нехватка памяти — та же ошибка, что у тайла
+        if (now) { if (!intset_add(g, &g->row_obst[y], x) || !intset_add(g, &g->col_obst[x], y)) g->oom = true; }
+        else { intset_remove(&g->row_obst[y], x); intset_remove(&g->col_obst[x], y); }
+    }
+    if (was_pit != now_pit) {
+        if (now_pit) { if (!intset_add(g, &g->row_pit[y], x) || !intset_add(g, &g->col_pit[x], y)) g->oom = true; }
+        else { intset_remove(&g->row_pit[y], x); intset_remove(&g->col_pit[x], y); }
+    }
+}
+
+// расстояние от pos до первого препятствия из set при движении по кольцу длины len
+// (1..len, len — препятствие в самой клетке pos), 0 если препятствий нет
+int obstacle_distance(IntSet *set, int pos, int len, bool forward) {
+    if (set->size == 0) return 0;
+    if (forward) {
+        int i = intset_lower(set, pos + 1);
+        return i < set->size ? set->v[i] - pos : set->v[0] + len - pos;
+    }
+    int j = intset_lower(set, pos) - 1;
+    return j >= 0 ? pos - set->v[j] : pos + len - set->v[set->size - 1];
+}
+
+// первое препятствие на пути из (x, y) в направлении (dx, dy), 0 если его нет
+int first_obstacle(Grid *g, int x, int y, int dx, int dy) {
+    if (dx != 0) return obstacle_distance(&g->row_obst[y], x, g->width, dx > 0);
+    return obstacle_distance(&g->col_obst[x], y, g->height, dy > 0);
+}
+
+// первая яма на пути, 0 если ее нет
+int first_pit(Grid *g, int x, int y, int dx, int dy) {
+    if (dx != 0) return obstacle_distance(&g->row_pit[y], x, g->width, dx > 0);
+    return obstacle_distance(&g->col_pit[x], y, g->height, dy > 0);
+}
+
+// все клетки пустые, тайлы еще не выделены
+bool grid_init(Grid *g, int width, int height) {
+    g->width = width; g->height = height;
+    g->tiles_x = (width + TILE_SIZE - 1) >> TILE_SHIFT;
+    g->tiles_y = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+    g->used = 0; g->oom = false; g->arena = NULL; g->index_arena = NULL;
+    g->tiles = calloc((size_t)g->tiles_x * g->tiles_y, sizeof(Cell *));
+    // все четыре индекса — одна таблица, их массивы — в арене индекса
+    IntSet *sets = calloc(2 * ((size_t)width + height), sizeof(IntSet));
+    g->row_obst = sets;
+    g->col_obst = sets ? sets + height : NULL;
+    g->row_pit = sets ? g->col_obst + width : NULL;
+    g->col_pit = sets ? g->row_pit + height : NULL;
+    return g->tiles && sets;
+}
+
+void grid_free(Grid *g) {
+    // тайлы освобождаются блоками арены, таблицу тайлов обходить не нужно
+    while (g->arena) { ArenaBlock *next = g->arena->next; free(g->arena); g->arena = next; }
+    // так же наборы индекса: обходить строки и столбцы не нужно
+    while (g->index_arena) { IntBlock *next = g->index_arena->next; free(g->index_arena); g->index_arena = next; }
+    free(g->tiles); free(g->row_obst);
+    g->tiles = NULL; g->row_obst = NULL; g->col_obst = NULL; g->row_pit = NULL; g->col_pit = NULL;
+}
+
+// для вывода поля: строка собирается в буфер и пишется одним fwrite
+bool print_field(FILE *out, Grid *g, int y, int x) {
+    size_t n = (size_t)g->width * 2 + 1;
+    char *buf = malloc(n);
+    if (!buf) return false;
+    bool ok = true;
+    for (int i = 0; i < g->height && ok; i++) {
+        char *p = buf;
+        for (int j = 0; j < g->width; j++) {
+            *p++ = (i == y && j == x) ? '#' : cell_symbol(grid_at(g, j, i));
+            *p++ = ' ';
+        }
+        *p++ = '\n';
+        ok = fwrite(buf, 1, n, out) == n;
+    }
+    if (ok) ok = fputc('\n', out) != EOF;
+    free(buf);
+    return ok;
+}
+
+// двоичный снимок поля: "MDNO", версия, ширина, высота, x, y (по 4 байта, little-endian),
+// дальше прогоны одинаковых клеток: длина (varint), terrain, paint
+#define SNAPSHOT_MAGIC "MDNO"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER 21
+#define SNAPSHOT_BUF (1 << 16)
+
+void put_u32(unsigned char *p, unsigned v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+unsigned get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+// число по 7 бит, старший бит — продолжение; не больше 10 байт
+unsigned char *put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) { *p++ = (unsigned char)(v | 0x80); v >>= 7; }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+bool get_varint(const unsigned char *p, size_t n, size_t *pos, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; shift <= 63; shift += 7) {
+        if (*pos >= n) return false;
+        unsigned char b = p[(*pos)++];
+        *v |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// дописывает прогон в буфер снимка, заполненный буфер сбрасывает в файл
+bool put_run(FILE *out, unsigned char *buf, size_t *n, size_t run, Cell c) {
+    // прогон занимает не больше 10 байт длины + 2 байта клетки
+    if (*n + 12 > SNAPSHOT_BUF) {
+        if (fwrite(buf, 1, *n, out) != *n) return false;
+        *n = 0;
+    }
+    unsigned char *p = put_varint(buf + *n, run);
+    *p++ = c.terrain; *p++ = c.paint;
+    *n = p - buf;
+    return true;
+}
+
+// в строке тайлов ty нет ни одного выделенного тайла
+bool tile_row_empty(Grid *g, int ty) {
+    Cell **t = &g->tiles[ty * g->tiles_x];
+    for (int tx = 0; tx < g->tiles_x; tx++) if (t[tx]) return false;
+    return true;
+}
+
+bool save_binary(FILE *out, Grid *g, int y, int x) {
+    unsigned char *buf = malloc(SNAPSHOT_BUF);
+    if (!buf) return false;
+    memcpy(buf, SNAPSHOT_MAGIC, 4); buf[4] = SNAPSHOT_VERSION;
+    put_u32(buf + 5, g->width); put_u32(buf + 9, g->height); put_u32(buf + 13, x); put_u32(buf + 17, y);
+    size_t n = SNAPSHOT_HEADER, run = 0;
+    Cell cur = empty_cell;
+    bool ok = true;
+    for (int i = 0; i < g->height && ok; i++) {
+        if ((i & TILE_MASK) == 0 && tile_row_empty(g, i >> TILE_SHIFT)) {
+            // пустая полоса тайлов целиком
+            int rows = g->height - i < TILE_SIZE ? g->height - i : TILE_SIZE;
+            if (run > 0 && !is_empty_cell(cur)) { ok = put_run(out, buf, &n, run, cur); run = 0; }
+            cur = empty_cell; run += (size_t)rows * g->width;
+            i += rows - 1;
+            continue;
+        }
+        for (int tx = 0; tx < g->tiles_x && ok; tx++) {
+            int len = g->width - (tx << TILE_SHIFT);
+            if (len > TILE_SIZE) len = TILE_SIZE;
+            const Cell *t = g->tiles[(i >> TILE_SHIFT) * g->tiles_x + tx];
+            if (!t) {
+                // нетронутый тайл — сразу вся его строка пустых клеток
+                if (run > 0 && !is_empty_cell(cur)) { ok = put_run(out, buf, &n, run, cur); run = 0; }
+                cur = empty_cell; run += len;
+                continue;
+            }
+            const Cell *row = t + ((i & TILE_MASK) << TILE_SHIFT);
+            for (int j = 0; j < len && ok; j++) {
+                if (run > 0 && (row[j].terrain != cur.terrain || row[j].paint != cur.paint)) { ok = put_run(out, buf, &n, run, cur); run = 0; }
+                cur = row[j]; run++;
+            }
+        }
+    }
+    if (ok && run > 0) ok = put_run(out, buf, &n, run, cur);
+    if (ok) ok = fwrite(buf, 1, n, out) == n;
+    free(buf);
+    return ok;
+}
+
+long long now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f); QueryPerformanceCounter(&c);
+    return (long long)(c.QuadPart * 1000000.0 / f.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+long long now_ms(void) {
+    return now_us() / 1000;
+}
+
+// пиковый объем памяти процесса в КБ (0, если узнать нельзя)
+long peak_rss_kb(void) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024; // на macOS в байтах
+#else
+    return ru.ru_maxrss;
+#endif
+#endif
+}
+
+void sleep_ms(long long ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0) {}
+#endif
+}
+
+// вывод поля в терминал: кадр собирается в один буфер и выводится одной записью,
+// после первого кадра — только изменившиеся клетки через позиционирование курсора;
+// поле больше VIEW_MAX показывается окном, которое следует за динозавром
+#define VIEW_MAX 100
+
+typedef struct {
+    int vw, vh;               // размер окна
+    int ox, oy;               // левый верхний угол окна на поле
+    char *prev;               // символы прошлого кадра
+    bool full;                // перерисовать экран целиком
+    char *out; size_t size, cap;
+    int interval_ms;
+    long long next_ms;        // когда показывать следующий кадр
+    bool skipped;             // последний кадр пропущен, на экране старое поле
+    int log_count;            // сколько сообщений было к прошлому кадру
+} Renderer;
+
+bool renderer_init(Renderer *r, Grid *g, int interval_ms) {
+    memset(r, 0, sizeof(*r));
+    r->vw = g->width < VIEW_MAX ? g->width : VIEW_MAX;
+    r->vh = g->height < VIEW_MAX ? g->height : VIEW_MAX;
+    r->prev = malloc((size_t)r->vw * r->vh);
+    if (!r->prev) return false;
+    r->full = true;
+    r->interval_ms = interval_ms;
+#ifdef _WIN32
+    // включаем ANSI-последовательности в консоли Windows
+    HANDLE con = GetStdHandle(STD_OUTPUT_HANDLE); DWORD mode;
+    if (GetConsoleMode(con, &mode)) SetConsoleMode(con, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+#endif
+    return true;
+}
+
+void renderer_free(Renderer *r) {
+    free(r->prev); free(r->out);
+    memset(r, 0, sizeof(*r));
+}
+
+void out_append(Renderer *r, const char *s, size_t n) {
+    if (r->size + n > r->cap) {
+        size_t ncap = r->cap ? r->cap * 2 : 4096;
+        while (ncap < r->size + n) ncap *= 2;
+        char *no = realloc(r->out, ncap);
+        if (!no) return;
+        r->out = no; r->cap = ncap;
+    }
+    memcpy(r->out + r->size, s, n);
+    r->size += n;
+}
+
+void out_flush(Renderer *r) {
+    fflush(stdout); // сначала все, что уже напечатано через stdio
+#ifdef _WIN32
+    fwrite(r->out, 1, r->size, stdout);
+    fflush(stdout);
+#else
+    size_t done = 0;
+    while (done < r->size) {
+        ssize_t n = write(STDOUT_FILENO, r->out + done, r->size - done);
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+#endif
+    r->size = 0;
+}
+
+// сдвигает окно по одной оси, когда динозавр подходит к краю ближе чем на четверть окна
+int view_origin(int o, int pos, int view, int len) {
+    if (view == len) return 0;
+    int rel = wrap(pos - o, len);
+    if (rel >= view / 4 && rel < view - view / 4) return o;
+    return wrap(pos - view / 2, len);
+}
+
+// выводит кадр сразу, без паузы
+void render_frame(Renderer *r, Grid *g, int x, int y, Log *log) {
+    // напечатанные сообщения сдвигают экран — тогда рисуем заново
+    if (log->count != r->log_count) { r->full = true; r->log_count = log->count; }
+    r->ox = view_origin(r->ox, x, r->vw, g->width);
+    r->oy = view_origin(r->oy, y, r->vh, g->height);
+    char pos[32];
+    if (r->full) out_append(r, "\x1b[H\x1b[2J", 7);
+    for (int i = 0; i < r->vh; i++) {
+        int fy = wrap(r->oy + i, g->height);
+        char *prow = r->prev + (size_t)i * r->vw;
+        int last = -2; // последняя выведенная клетка строки, курсор стоит сразу за ней
+        for (int j = 0; j < r->vw; j++) {
+            int fx = wrap(r->ox + j, g->width);
+            char c = (fy == y && fx == x) ? '#' : cell_symbol(grid_at(g, fx, fy));
+            if (!r->full && prow[j] == c) continue;
+            prow[j] = c;
+            if (!r->full && last != j - 1) {
+                int n = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", i + 1, 2 * j + 1);
+                out_append(r, pos, (size_t)n);
+            }
+            char cell[2] = { c, ' ' };
+            out_append(r, cell, 2);
+            last = j;
+        }
+        if (r->full) out_append(r, "\n", 1);
+    }
+    if (r->full) out_append(r, "\n", 1);
+    else {
+        // курсор под поле, чтобы сообщения печатались ниже
+        int n = snprintf(pos, sizeof(pos), "\x1b[%d;1H", r->vh + 2);
+        out_append(r, pos, (size_t)n);
+    }
+    out_flush(r);
+    r->full = false;
+    r->skipped = false;
+}
+
+// кадр после шага: выдерживает интервал, а если скрипт отстает от расписания — пропускает кадр
+void render_step(Renderer *r, Grid *g, int x, int y, Log *log) {
+    long long now = now_ms();
+    if (r->next_ms == 0) r->next_ms = now;
+    r->next_ms += r->interval_ms;
+    if (now >= r->next_ms) { r->skipped = true; return; }
+    render_frame(r, g, x, y, log);
+    now = now_ms();
+    if (now < r->next_ms) sleep_ms(r->next_ms - now);
+}
+
+// запоминаем старое значение клетки перед изменением
+void record_cell(History *hist, Grid *g, int cx, int cy) {
+    if (hist->ssize == 0) return; // до START/LOAD откатывать некуда
+    if (hist->csize == hist->ccap) {
+        int ncap = hist->ccap ? hist->ccap * 2 : 64;
+        CellChange *nc = realloc(hist->changes, ncap * sizeof(CellChange));
+        if (!nc) return; // мягкий выход
+        hist->changes = nc; hist->ccap = ncap;
+    }
+    CellChange *c = &hist->changes[hist->csize++];
+    c->tile = tile_index(g, cx, cy);
+    c->off = (unsigned short)tile_offset(cx, cy);
+    c->old = *grid_at(g, cx, cy);
+}
+
+void set_terrain(History *hist, Grid *g, int cx, int cy, char t) {
+    Cell c = *grid_at(g, cx, cy);
+    if (c.terrain == t) return;
+    record_cell(hist, g, cx, cy);
+    c.terrain = t;
+    grid_put(g, cx, cy, c);
+}
+
+void set_paint(History *hist, Grid *g, int cx, int cy, char p) {
+    Cell c = *grid_at(g, cx, cy);
+    if (c.paint == p) return;
+    record_cell(hist, g, cx, cy);
+    c.paint = p;
+    grid_put(g, cx, cy, c);
+}
+
+// оставляет последние limit шагов и их изменения
+void hist_trim(History *hist) {
+    int drop = hist->ssize - hist->limit, cstart = hist->steps[drop].start;
+    memmove(hist->changes, hist->changes + cstart, (hist->csize - cstart) * sizeof(CellChange));
+    hist->csize -= cstart;
+    memmove(hist->steps, hist->steps + drop, hist->limit * sizeof(Step));
+    hist->ssize = hist->limit;
+    for (int i = 0; i < hist->ssize; i++) hist->steps[i].start -= cstart;
+}
+
+// сохраняем историю: закрываем шаг, сами клетки уже в журнале
+void push_state(History *hist, int px, int py) {
+    if (hist->off) return; // без шагов record_cell тоже ничего не пишет
+    // старые шаги отбрасываются пачкой, когда их набирается вдвое больше нужного
+    if (hist->limit && hist->ssize >= 2 * hist->limit + 64) hist_trim(hist);
+    if (hist->ssize == hist->scap) {
+        int ncap = hist->scap ? hist->scap * 2 : 16;
+        Step *ns = realloc(hist->steps, ncap * sizeof(Step)); // увеличить размер массива
+        if (!ns) return; // мягкий выход
+        hist->steps = ns; hist->scap = ncap;
+    }
+    Step *st = &hist->steps[hist->ssize++];
+    st->start = hist->csize;
+    st->x = px; st->y = py;
+}
+
+// undo на n шагов
+void pop_state(History *hist, Grid *g, long long n, int *px, int *py) {
+    /*
+    1 Если история пуста или одна запись — выход.
+    2 Убирает n последних шагов (не дальше начального), шаг перед ними становится текущим.
+    3 Откатывает журнал с конца до начала этого шага одним проходом, клетки меняются на месте.
+    4 Обновляет координаты px и py из шага.
+    */
+
+    if (hist->ssize <= 1) return;
+    hist->ssize = n < hist->ssize - 1 ? hist->ssize - (int)n : 1;
+    Step *prev = &hist->steps[hist->ssize - 1];
+    while (hist->csize > prev->start) {
+        CellChange *c = &hist->changes[--hist->csize];
+        int cx = (c->tile % g->tiles_x) << TILE_SHIFT | (c->off & TILE_MASK);
+        int cy = (c->tile / g->tiles_x) << TILE_SHIFT | c->off >> TILE_SHIFT;
+        grid_put(g, cx, cy, c->old);
+    }
+    *px = prev->x; *py = prev->y;
+}
+
+// очистка истории
+void cleanup(History *hist, Grid *g) {
+    grid_free(g);
+    free(hist->changes); free(hist->steps);
+    memset(hist, 0, sizeof(*hist));
+}
+
+
+// входной файл целиком в памяти (mmap или чтение одним блоком);
+// строки отдаются указателями прямо в буфер, без копирования и без ограничения длины
+typedef struct {
+    char *data;
+    size_t size;
+    bool mapped;  // data — файл, отображенный только для чтения
+    size_t pos;
+    int lnum; // номер последней отданной строки
+    char *line; size_t lcap; // отображенный файл: копия текущей строки с \0 в конце
+    bool oom;     // строка не поместилась в память: source_next вернул NULL раньше конца файла
+} Source;
+
+bool source_open(Source *src, const char *fname) {
+    memset(src, 0, sizeof(*src));
+#ifndef _WIN32
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    // только чтение: страницы файла не копируются, строки source_next копирует по одной
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+            src->data = p; src->size = (size_t)st.st_size; src->mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    FILE *fp = fopen(fname, "rb");
+    if (!fp) return false;
+    size_t cap = 1 << 16;
+    src->data = malloc(cap + 1);
+    if (!src->data) { fclose(fp); return false; }
+    size_t n;
+    while ((n = fread(src->data + src->size, 1, cap - src->size, fp)) > 0) {
+        src->size += n;
+        if (src->size == cap) {
+            char *nd = realloc(src->data, cap * 2 + 1);
+            if (!nd) { free(src->data); src->data = NULL; fclose(fp); return false; }
+            src->data = nd; cap *= 2;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// следующая строка без \n и \r в конце, NULL в конце файла (или при нехватке памяти, тогда src->oom).
+// Свой буфер меняется на месте, строка отображенного файла копируется в src->line
+char *source_next(Source *src) {
+    if (src->pos >= src->size) return NULL;
+    char *start = src->data + src->pos;
+    char *nl = memchr(start, '\n', src->size - src->pos);
+    char *end = nl ? nl : src->data + src->size;
+    src->pos = (size_t)(end - src->data) + 1;
+    if (end > start && end[-1] == '\r') end--;
+    src->lnum++;
+    if (!src->mapped) { *end = '\0'; return start; }
+    size_t len = (size_t)(end - start);
+    if (len + 1 > src->lcap) {
+        size_t ncap = src->lcap ? src->lcap * 2 : 256;
+        while (ncap < len + 1) ncap *= 2;
+        char *nb = realloc(src->line, ncap);
+        if (!nb) { src->oom = true; src->pos = src->size; return NULL; }
+        src->line = nb; src->lcap = ncap;
+    }
+    memcpy(src->line, start, len);
+    src->line[len] = '\0';
+    return src->line;
+}
+
+void source_close(Source *src) {
+#ifndef _WIN32
+    if (src->mapped) munmap(src->data, src->size);
+    else
 #endif
+    free(src->data);
+    free(src->line);
+    memset(src, 0, sizeof(*src));
+}
+
+// used — сколько байт занял снимок (NULL, если не нужно)
+bool load_binary(Grid *g, const unsigned char *p, size_t n, int *x, int *y, size_t *used, int lnum, Log *log) {
+    if (n < SNAPSHOT_HEADER || p[4] != SNAPSHOT_VERSION) { log_msg(log, "Error: invalid LOAD format at line %d\n", lnum); return false; }
+    unsigned w = get_u32(p + 5), h = get_u32(p + 9), lx = get_u32(p + 13), ly = get_u32(p + 17);
+    if (w != (unsigned)g->width || h != (unsigned)g->height) {
+        log_msg(log, "Error: LOAD size %ux%u does not match SIZE at line %d\n", w, h, lnum);
+        return false;
+    }
+    if (lx >= w || ly >= h) { log_msg(log, "Error: invalid LOAD format at line %d\n", lnum); return false; }
+    size_t total = (size_t)w * h, idx = 0, pos = SNAPSHOT_HEADER;
+    while (idx < total) {
+        unsigned long long run;
+        if (!get_varint(p, n, &pos, &run) || pos + 2 > n || run == 0 || run > total - idx) { log_msg(log, "Error: invalid LOAD format at line %d\n", lnum); return false; }
+        Cell c = { (char)p[pos], (char)p[pos + 1] }; pos += 2;
+        // поле после grid_init пустое, пустые прогоны только пропускаем
+        if (is_empty_cell(c)) { idx += run; continue; }
+        for (size_t k = 0; k < run; k++, idx++) grid_put(g, (int)(idx % w), (int)(idx / w), c);
+        if (g->oom) { log_msg(log, "Error: out of memory\n"); return false; }
+    }
+    *x = (int)lx; *y = (int)ly;
+    if (used) *used = pos;
+    return true;
+}
+
+// LOAD: текстовый вид поля (как в выходном файле) или двоичный снимок, формат по сигнатуре
+bool load_field(Grid *g, const char *fname, int *x, int *y, int lnum, Log *log) {
+    Source loadf; if (!source_open(&loadf, fname)) { log_msg(log, "Error: cannot open '%s' at line %d\n", fname, lnum); return false; }
+    if (loadf.size >= 4 && memcmp(loadf.data, SNAPSHOT_MAGIC, 4) == 0) {
+        bool ok = load_binary(g, (const unsigned char *)loadf.data, loadf.size, x, y, NULL, lnum, log);
+        source_close(&loadf);
+        return ok;
+    }
+    char *row; bool found_dino = false;
+    for (int i = 0; i < g->height; i++) {
+        if (!(row = source_next(&loadf))) {
+            if (loadf.oom) log_msg(log, "Error: out of memory\n");
+            else log_msg(log, "Error: incomplete LOAD at line %d\n", lnum);
+            source_close(&loadf); return false;
+        }
+        char *p = row; for (int j = 0; j < g->width; j++) {
+            char c = p[0]; if (c == '\0' || p[1] != ' ') { log_msg(log, "Error: invalid LOAD format at line %d\n", lnum); source_close(&loadf); return false; }
+            p += 2; if (c == '#') { *x = j; *y = i; found_dino = true; }
+            else if (c >= 'a' && c <= 'z') grid_put(g, j, i, (Cell){ '_', c }); else grid_put(g, j, i, (Cell){ c, '\0' });
+        }
+        if (g->oom) { log_msg(log, "Error: out of memory\n"); source_close(&loadf); return false; }
+    }
+    source_close(&loadf); if (!found_dino) { log_msg(log, "Error: no # in LOAD at line %d\n", lnum); return false; }
+    return true;
+}
+
+// первое слово строки s (без ограничения длины) в новом буфере, "" — слова нет;
+// *end — смещение сразу за словом. NULL — нет памяти
+char *token_dup(const char *s, int *end) {
+    int b = 0, e = 0;
+    while (s[b] == ' ' || s[b] == '\t') b++;
+    for (e = b; s[e] != '\0' && s[e] != ' ' && s[e] != '\t'; e++) {}
+    char *tok = malloc((size_t)(e - b) + 1);
+    if (!tok) return NULL;
+    memcpy(tok, s + b, (size_t)(e - b));
+    tok[e - b] = '\0';
+    if (end) *end = e;
+    return tok;
+}
+
+// строка "LOAD <файл>" целиком: одинаковый разбор имени для обычного запуска, serve и solve
+bool load_line(Grid *g, const char *line, int *x, int *y, int lnum, Log *log) {
+    char *fname = token_dup(line + 5, NULL);
+    if (!fname) { log_msg(log, "Error: out of memory\n"); return false; }
+    bool ok = fname[0] != '\0';
+    if (!ok) log_msg(log, "Error: invalid LOAD at line %d\n", lnum);
+    else ok = load_field(g, fname, x, y, lnum, log);
+    free(fname);
+    return ok;
+}
+
+// сохранение итогового поля в текстовом или двоичном виде
+bool save_field(const char *fname, Grid *g, int y, int x, bool binary) {
+    FILE *out = fopen(fname, binary ? "wb" : "w");
+    if (!out) return false;
+    bool ok = binary ? save_binary(out, g, y, x) : print_field(out, g, y, x);
+    if (fclose(out) != 0) ok = false;
+    return ok;
+}
+
+#define EXEC_MAX_DEPTH 10 // предел вложенности EXEC и IF CELL
+#define REPEAT_MAX_DEPTH 64 // предел вложенности блоков REPEAT в одном файле: их разбор и выполнение рекурсивны
+
+// коды команд после разбора
+typedef enum {
+    OP_UNDO, OP_MOVE, OP_PAINT, OP_DIG, OP_MOUND, OP_JUMP,
+    OP_GROW, OP_CUT, OP_MAKE, OP_PUSH, OP_EXEC, OP_IF,
+    OP_REPEAT, // тело из body инструкций выполняется arg раз
+    OP_FUSED,  // перед серией из arg одинаковых MOVE или PAINT (они идут следом, body = arg)
+    OP_REWIND, // откат истории до шага arg
+    OP_COUNT
+} OpCode;
+
+const char *op_names[OP_COUNT] = {
+    "UNDO", "MOVE", "PAINT", "DIG", "MOUND", "JUMP",
+    "GROW", "CUT", "MAKE", "PUSH", "EXEC", "IF CELL",
+    "REPEAT", "FUSED", "REWIND"
+};
+
+// одна разобранная команда
+typedef struct {
+    OpCode op;
+    int dx, dy;   // направление; для IF CELL — координаты клетки
+    int arg;      // JUMP: дальность, PAINT и IF CELL: символ, EXEC: номер имени файла, REPEAT и FUSED: число повторов
+    int body;     // IF CELL, REPEAT, FUSED: сколько следующих инструкций входят в тело
+    int line;
+    bool nested;  // часть тела IF CELL
+} Instr;
+
+// разобранный файл: команды подряд, имена файлов для EXEC отдельно
+typedef struct {
+    Instr *code; int size, cap;
+    char **names; int nnames;
+    char *ctx; // имя файла для сообщений
+    Log *log;  // куда писать ошибки разбора
+    int max_line;
+    long long *hits, *taken; // режим profile: выполнения строки и срабатывания THEN, по номеру строки
+    int trace_id; // режим trace: номер имени файла в trace, 0 — еще не записано
+    int *blocks; int nblocks, bcap; // при разборе: незакрытые REPEAT
+} Program;
+
+// разобранный файл для EXEC и то, по чему видно, что файл изменился
+typedef struct {
+    Program prog;
+    time_t mtime;
+    long long size;
+    int busy; // сколько EXEC сейчас выполняют эту программу
+    long long undos[EXEC_MAX_DEPTH + 1]; // count_undo по глубине вызова
+    bool undos_known[EXEC_MAX_DEPTH + 1];
+    Memo *memo; int nmemo;  // режим memo: сохраненные вызовы, последний совпавший — первый
+    int memo_fails;         // сколько вызовов не удалось записать
+} ExecEntry;
+
+// кэш EXEC по имени файла, общий для всех вызовов и глубин
+typedef struct {
+    ExecEntry **entries; int size, cap;
+    ExecEntry **retired; int nretired; // устаревшие версии: могут еще выполняться, в них счетчики profile
+} ExecCache;
+
+// счетчики режима profile; время в микросекундах, у EXEC и IF CELL — вместе с вложенными командами,
+// max_depth — наибольшая вложенность EXEC и IF CELL
+typedef struct {
+    long long op_count[OP_COUNT], op_us[OP_COUNT];
+    long long push_count, push_us;
+    long long pop_count, pop_us;
+    long long render_count, render_us;
+    size_t peak_history; // байт
+    int max_depth;
+} Profile;
+
+// состояние интерпретатора
+typedef struct {
+    Grid grid;
+    int x, y;
+    History hist;
+    ExecCache exec_cache;
+    Log *log;
+    bool display;
+    int interval_ms;
+    Renderer render;
+    long long executed; // сколько команд выполнено
+    Profile *prof;      // NULL, если profile выключен
+    bool fuse;          // серии MOVE и PAINT выполняются одной операцией (нет profile, trace и покадрового вывода)
+    bool memo;          // результаты EXEC запоминаются и повторяются (опция memo, нет UNDO и условий для fuse)
+} Interp;
+
+#define MEMO_MAX 32 // сколько вызовов одного файла EXEC хранится (и сколько неудачных записей допускается)
+
+// сохраненный вызов, который повторится на текущем поле с позиции (x, y) на глубине depth, или NULL
+Memo *memo_find(Grid *g, ExecEntry *e, int x, int y, int depth) {
+    for (int i = 0; i < e->nmemo; i++) {
+        Memo *m = &e->memo[i];
+        if (depth + m->depth >= EXEC_MAX_DEPTH) continue; // вложенный EXEC остановил бы скрипт
+        if (m->absolute && (m->sx != x || m->sy != y)) continue;
+        int k = 0;
+        for (; k < m->nreads; k++) {
+            const MemoCell *r = &m->reads[k];
+            const Cell *c = grid_at(g, wrap(x + r->dx, g->width), wrap(y + r->dy, g->height));
+            if (c->terrain != r->c.terrain || c->paint != r->c.paint) break;
+        }
+        if (k < m->nreads) continue;
+        if (i > 0) { Memo t = e->memo[i]; memmove(e->memo + 1, e->memo, i * sizeof(Memo)); e->memo[0] = t; }
+        return &e->memo[0];
+    }
+    return NULL;
+}
+
+// повторяет сохраненный вызов: записанные клетки и сдвиг динозавра
+void memo_apply(Grid *g, const Memo *m, int *x, int *y) {
+    for (int k = 0; k < m->nwrites; k++) {
+        const MemoCell *w = &m->writes[k];
+        grid_put(g, wrap(*x + w->dx, g->width), wrap(*y + w->dy, g->height), w->c);
+    }
+    *x = wrap(*x + m->dx, g->width);
+    *y = wrap(*y + m->dy, g->height);
+}
+
+// завершает запись вызова: keep — сохранить в e, иначе выбросить и засчитать неудачу
+void memo_store(ExecEntry *e, Memo *m, bool keep) {
+    free(m->keys); free(m->ridx); free(m->widx);
+    m->keys = NULL; m->ridx = m->widx = NULL; m->ksize = m->kcount = 0;
+    Memo *nm = keep ? realloc(e->memo, (e->nmemo + 1) * sizeof(Memo)) : NULL;
+    if (!nm) { memo_free(m); e->memo_fails++; return; }
+    e->memo = nm;
+    e->memo[e->nmemo++] = *m;
+}
+
+// команды вида "ИМЯ НАПРАВЛЕНИЕ"
+typedef struct {
+    const char *name;
+    OpCode op;
+} DirCommand;
+
+DirCommand dir_commands[] = {
+    {"MOVE", OP_MOVE}, {"DIG", OP_DIG}, {"MOUND", OP_MOUND}, {"GROW", OP_GROW},
+    {"CUT", OP_CUT}, {"MAKE", OP_MAKE}, {"PUSH", OP_PUSH},
+};
+
+void program_init(Program *prog, const char *ctx, Log *log) {
+    memset(prog, 0, sizeof(*prog));
+    prog->log = log;
+    prog->ctx = malloc(strlen(ctx) + 1);
+    if (prog->ctx) strcpy(prog->ctx, ctx);
+}
+
+void program_free(Program *prog) {
+    for (int i = 0; i < prog->nnames; i++) free(prog->names[i]);
+    free(prog->names); free(prog->code); free(prog->ctx);
+    free(prog->hits); free(prog->taken); free(prog->blocks);
+    memset(prog, 0, sizeof(*prog));
+}
+
+// добавляет инструкцию, возвращает ее индекс или -1
+int emit(Program *prog, OpCode op, int dx, int dy, int arg, int lnum) {
+    if (prog->size == prog->cap) {
+        int ncap = prog->cap ? prog->cap * 2 : 64;
+        Instr *nc = realloc(prog->code, ncap * sizeof(Instr));
+        if (!nc) { log_msg(prog->log, "Error: out of memory\n"); return -1; }
+        prog->code = nc; prog->cap = ncap;
+    }
+    Instr *ins = &prog->code[prog->size];
+    ins->op = op; ins->dx = dx; ins->dy = dy; ins->arg = arg; ins->body = 0; ins->line = lnum; ins->nested = false;
+    if (lnum > prog->max_line) prog->max_line = lnum;
+    return prog->size++;
+}
+
+int add_name(Program *prog, const char *name, size_t len) {
+    char **nn = realloc(prog->names, (prog->nnames + 1) * sizeof(char *));
+    if (!nn) return -1;
+    prog->names = nn;
+    prog->names[prog->nnames] = malloc(len + 1);
+    if (!prog->names[prog->nnames]) return -1;
+    memcpy(prog->names[prog->nnames], name, len);
+    prog->names[prog->nnames][len] = '\0';
+    return prog->nnames++;
+}
+
+bool parse_dir(const char *dir, int *dx, int *dy) {
+    *dx = 0; *dy = 0;
+    if (strcmp(dir, "UP") == 0) *dy = -1;
+    else if (strcmp(dir, "DOWN") == 0) *dy = 1;
+    else if (strcmp(dir, "LEFT") == 0) *dx = -1;
+    else if (strcmp(dir, "RIGHT") == 0) *dx = 1;
+    else return false;
+    return true;
+}
+
+// разбор одной строки в инструкции, все синтаксические ошибки здесь
+bool compile_line(Program *prog, const char *line, int lnum) {
+    const char *ctx = prog->ctx;
+    size_t len = strlen(line);
+    if (len >= 2 && line[0] == '/' && line[1] == '/') return true;
+    if (len == 0) return true;
+    if (line[0] == ' ') { log_msg(prog->log, "Error: leading spaces %s line %d\n", ctx, lnum); return false; }
+
+    int dx = 0, dy = 0; char dir[10];
+
+    if (strncmp(line, "UNDO", 4) == 0 && (len == 4 || (line[4] == ' ' && line[5] == '\0'))) {
+        return emit(prog, OP_UNDO, 0, 0, 1, lnum) >= 0;
+    }
+    if (strncmp(line, "UNDO ", 5) == 0) {
+        int n; char extra[2];
+        if (sscanf(line + 5, "%d %1s", &n, extra) != 1 || n < 1) {
+            log_msg(prog->log, "Error: invalid UNDO command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        return emit(prog, OP_UNDO, 0, 0, n, lnum) >= 0;
+    }
+    if (strncmp(line, "REWIND ", 7) == 0) {
+        int k; char extra[2];
+        if (strncmp(line + 7, "TO ", 3) != 0 || sscanf(line + 10, "%d %1s", &k, extra) != 1 || k < 0) {
+            log_msg(prog->log, "Error: invalid REWIND command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        return emit(prog, OP_REWIND, 0, 0, k, lnum) >= 0;
+    }
+    for (size_t k = 0; k < sizeof(dir_commands) / sizeof(dir_commands[0]); k++) {
+        const char *name = dir_commands[k].name;
+        size_t nlen = strlen(name);
+        if (strncmp(line, name, nlen) != 0 || line[nlen] != ' ') continue;
+        if (sscanf(line + nlen + 1, "%9s", dir) != 1) {
+            log_msg(prog->log, "Error: invalid %s command syntax %s line %d\n", name, ctx, lnum);
+            return false;
+        }
+        // Проверяем, что после направления нет лишних символов
+        char extra[100];
+        if (sscanf(line + nlen + 1 + strlen(dir), "%99s", extra) == 1) {
+            log_msg(prog->log, "Error: extra characters after %s command %s line %d\n", name, ctx, lnum);
+            return false;
+        }
+        if (!parse_dir(dir, &dx, &dy)) {
+            log_msg(prog->log, "Error: invalid direction '%s' in %s command %s line %d\n", dir, name, ctx, lnum);
+            return false;
+        }
+        return emit(prog, dir_commands[k].op, dx, dy, 0, lnum) >= 0;
+    }
+    if (strncmp(line, "PAINT ", 6) == 0) {
+        char ch;
+        char extra[100];
+        if (sscanf(line + 6, " %c%99s", &ch, extra) != 1) {
+            log_msg(prog->log, "Error: invalid PAINT command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        if (ch < 'a' || ch > 'z') {
+            log_msg(prog->log, "Error: invalid paint character '%c' (must be a-z) %s line %d\n", ch, ctx, lnum);
+            return false;
+        }
+        return emit(prog, OP_PAINT, 0, 0, ch, lnum) >= 0;
+    } else if (strncmp(line, "JUMP ", 5) == 0) {
+        int n;
+        char extra[100];
+        if (sscanf(line + 5, "%9s %d%99s", dir, &n, extra) != 2) {
+            log_msg(prog->log, "Error: invalid JUMP command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        if (n < 0) {
+            log_msg(prog->log, "Error: negative jump distance %s line %d\n", ctx, lnum);
+            return false;
+        }
+        if (!parse_dir(dir, &dx, &dy)) {
+            log_msg(prog->log, "Error: invalid direction '%s' in JUMP command %s line %d\n", dir, ctx, lnum);
+            return false;
+        }
+        if (n == 0) return true; // прыжок на месте ничего не делает и в историю не идет
+        return emit(prog, OP_JUMP, dx, dy, n, lnum) >= 0;
+    } else if (strncmp(line, "EXEC ", 5) == 0) {
+        int fs = -1, fe = -1;
+        char extra[100];
+        sscanf(line + 5, " %n%*s%n", &fs, &fe);
+        if (fe < 0 || sscanf(line + 5 + fe, "%99s", extra) == 1) {
+            log_msg(prog->log, "Error: invalid EXEC command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        int id = add_name(prog, line + 5 + fs, (size_t)(fe - fs));
+        if (id < 0) { log_msg(prog->log, "Error: out of memory\n"); return false; }
+        return emit(prog, OP_EXEC, 0, 0, id, lnum) >= 0;
+    } else if (strncmp(line, "REPEAT ", 7) == 0) {
+        int n;
+        char extra[100];
+        if (sscanf(line + 7, "%d%99s", &n, extra) != 1 || n < 0) {
+            log_msg(prog->log, "Error: invalid REPEAT command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        if (prog->nblocks >= REPEAT_MAX_DEPTH) {
+            log_msg(prog->log, "Error: REPEAT nesting too deep %s line %d\n", ctx, lnum);
+            return false;
+        }
+        if (prog->nblocks == prog->bcap) {
+            int ncap = prog->bcap ? prog->bcap * 2 : 8;
+            int *nb = realloc(prog->blocks, ncap * sizeof(int));
+            if (!nb) { log_msg(prog->log, "Error: out of memory\n"); return false; }
+            prog->blocks = nb; prog->bcap = ncap;
+        }
+        int at = emit(prog, OP_REPEAT, 0, 0, n, lnum);
+        if (at < 0) return false;
+        prog->blocks[prog->nblocks++] = at;
+        return true;
+    } else if (strncmp(line, "END", 3) == 0 && (len == 3 || (line[3] == ' ' && line[4] == '\0'))) {
+        if (prog->nblocks == 0) {
+            log_msg(prog->log, "Error: END without REPEAT %s line %d\n", ctx, lnum);
+            return false;
+        }
+        int at = prog->blocks[--prog->nblocks];
+        prog->code[at].body = prog->size - at - 1;
+        return true;
+    } else if (strncmp(line, "IF CELL ", 8) == 0) {
+        // каждое IF CELL цепочки "IF CELL ... THEN IF CELL ..." — уровень вложенности, предел тот же, что у EXEC
+        int chain = 0;
+        for (const char *p = line; chain <= EXEC_MAX_DEPTH && strncmp(p, "IF CELL ", 8) == 0; chain++) {
+            const char *t = strstr(p, " THEN ");
+            if (!t) break;
+            p = t + 6;
+        }
+        if (chain > EXEC_MAX_DEPTH) {
+            log_msg(prog->log, "Error: IF CELL nesting too deep %s line %d\n", ctx, lnum);
+            return false;
+        }
+        int cx, cy; char isym; int then_at = -1;
+        // Более строгая проверка синтаксиса IF CELL; тело THEN — весь остаток строки
+        if (sscanf(line, "IF CELL %d %d IS %c THEN %n", &cx, &cy, &isym, &then_at) != 3 || then_at < 0 || line[then_at] == '\0') {
+            log_msg(prog->log, "Error: invalid IF CELL command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        int at = emit(prog, OP_IF, cx, cy, isym, lnum);
+        if (at < 0) return false;
+        // тело THEN идет сразу за IF; блок REPEAT ... END в нем не поместится
+        int open = prog->nblocks;
+        if (!compile_line(prog, line + then_at, lnum)) return false;
+        if (prog->nblocks != open) {
+            log_msg(prog->log, "Error: invalid IF CELL command syntax %s line %d\n", ctx, lnum);
+            return false;
+        }
+        prog->code[at].body = prog->size - at - 1;
+        for (int k = at + 1; k < prog->size; k++) prog->code[k].nested = true;
+        return true;
+    }
+    // Любая другая строка, которая не соответствует ни одному известному формату команды
+    log_msg(prog->log, "Error: unknown command '%s' %s line %d\n", line, ctx, lnum);
+    return false;
+}
+
+// копирует инструкции [begin, end) в out и ставит OP_FUSED перед каждой серией одинаковых MOVE или PAINT;
+// возвращает, сколько инструкций записано
+int fuse_range(const Instr *code, int begin, int end, Instr *out) {
+    int n = 0;
+    for (int pc = begin; pc < end; ) {
+        const Instr *ins = &code[pc];
+        if (ins->op == OP_REPEAT) {
+            int at = n;
+            out[n++] = *ins;
+            n += fuse_range(code, pc + 1, pc + 1 + ins->body, out + n);
+            out[at].body = n - at - 1;
+            pc += 1 + ins->body;
+            continue;
+        }
+        if (ins->op == OP_IF) {
+            // тело IF CELL не трогаем
+            memcpy(out + n, ins, (1 + ins->body) * sizeof(Instr));
+            n += 1 + ins->body;
+            pc += 1 + ins->body;
+            continue;
+        }
+        int k = 1;
+        if (ins->op == OP_MOVE || ins->op == OP_PAINT) {
+            while (pc + k < end && code[pc + k].op == ins->op && code[pc + k].dx == ins->dx
+                   && code[pc + k].dy == ins->dy && code[pc + k].arg == ins->arg) k++;
+        }
+        if (k > 1) {
+            out[n] = *ins;
+            out[n].op = OP_FUSED; out[n].arg = k; out[n].body = k;
+            n++;
+        }
+        memcpy(out + n, ins, k * sizeof(Instr));
+        n += k; pc += k;
+    }
+    return n;
+}
+
+// конец разбора файла: все REPEAT закрыты, дальше оптимизация серий
+bool program_finish(Program *prog) {
+    if (prog->nblocks > 0) {
+        Instr *open = &prog->code[prog->blocks[prog->nblocks - 1]];
+        log_msg(prog->log, "Error: REPEAT without END %s line %d\n", prog->ctx, open->line);
+        return false;
+    }
+    // OP_FUSED не больше, чем по одной на две инструкции
+    int cap = prog->size * 3 / 2 + 1;
+    Instr *out = malloc((size_t)cap * sizeof(Instr));
+    if (!out) { log_msg(prog->log, "Error: out of memory\n"); return false; }
+    int n = fuse_range(prog->code, 0, prog->size, out);
+    free(prog->code);
+    prog->code = out; prog->size = n; prog->cap = cap;
+    return true;
+}
+
+// разбор файла для EXEC
+bool compile_file(Program *prog, Source *src) {
+    char *line;
+    while ((line = source_next(src))) {
+        if (line[0] == '\0' || (line[0] == '/' && line[1] == '/')) continue;
+        if (line[0] == ' ') {
+            log_msg(prog->log, "Error: leading spaces in %s line %d\n", prog->ctx, src->lnum);
+            return false;
+        }
+        if (!compile_line(prog, line, src->lnum)) return false;
+    }
+    if (src->oom) { log_msg(prog->log, "Error: out of memory\n"); return false; }
+    return program_finish(prog);
+}
+
+void exec_entry_free(ExecEntry *e) {
+    for (int i = 0; i < e->nmemo; i++) memo_free(&e->memo[i]);
+    free(e->memo);
+    program_free(&e->prog);
+    free(e);
+}
+
+// разобранный файл из кэша; файл читается только при первом обращении или если изменился.
+// NULL и *open_failed, если файла нет; NULL без него, если в файле ошибка (уже напечатана)
+ExecEntry *exec_cache_get(ExecCache *cache, const char *fname, Log *log, bool *open_failed) {
+    *open_failed = false;
+    struct stat st;
+    if (stat(fname, &st) != 0) { *open_failed = true; return NULL; }
+
+    int slot = -1;
+    for (int i = 0; i < cache->size; i++) {
+        if (strcmp(cache->entries[i]->prog.ctx, fname) == 0) { slot = i; break; }
+    }
+    if (slot >= 0) {
+        ExecEntry *e = cache->entries[slot];
+        if (e->mtime == st.st_mtime && e->size == (long long)st.st_size) return e;
+    }
+
+    Source src;
+    if (!source_open(&src, fname)) { *open_failed = true; return NULL; }
+    ExecEntry *e = calloc(1, sizeof(ExecEntry));
+    if (!e) { source_close(&src); log_msg(log, "Error: out of memory\n"); return NULL; }
+    program_init(&e->prog, fname, log);
+    bool ok = compile_file(&e->prog, &src);
+    source_close(&src);
+    if (!ok) { exec_entry_free(e); return NULL; }
+    e->mtime = st.st_mtime; e->size = (long long)st.st_size;
+
+    if (slot >= 0) {
+        // старую версию нельзя освободить, пока она выполняется выше по стеку, и в ней счетчики profile
+        ExecEntry *old = cache->entries[slot];
+        if (old->busy || old->prog.hits) {
+            ExecEntry **nr = realloc(cache->retired, (cache->nretired + 1) * sizeof(ExecEntry *));
+            if (!nr) { exec_entry_free(e); log_msg(log, "Error: out of memory\n"); return NULL; }
+            cache->retired = nr;
+            cache->retired[cache->nretired++] = old;
+        } else {
+            exec_entry_free(old);
+        }
+        cache->entries[slot] = e;
+        return e;
+    }
+    if (cache->size == cache->cap) {
+        int ncap = cache->cap ? cache->cap * 2 : 8;
+        ExecEntry **ne = realloc(cache->entries, ncap * sizeof(ExecEntry *));
+        if (!ne) { exec_entry_free(e); log_msg(log, "Error: out of memory\n"); return NULL; }
+        cache->entries = ne; cache->cap = ncap;
+    }
+    cache->entries[cache->size++] = e;
+    return e;
+}
+
+#define UNDO_UNBOUNDED (1LL << 40) // столько UNDO или больше — считаем, что без ограничения
+
+// сколько раз может выполниться UNDO в инструкциях [begin, end) программы на глубине depth; оценка сверху:
+// каждый IF CELL считается сработавшим, а тело — на той же глубине, тело REPEAT — столько раз, сколько повторов.
+// Файлы EXEC разбираются заранее через кэш, ошибки разбора идут в log; -1, если какой-то файл открыть или разобрать нельзя
+long long count_undo(ExecCache *cache, Program *prog, int begin, int end, int depth, Log *log) {
+    long long total = 0;
+    for (int pc = begin; pc < end && total < UNDO_UNBOUNDED; pc++) {
+        Instr *ins = &prog->code[pc];
+        if (ins->op == OP_UNDO) total += ins->arg;
+        if (ins->op == OP_REWIND) total = UNDO_UNBOUNDED; // нужен любой шаг от начала
+        if (ins->op == OP_REPEAT) {
+            long long k = count_undo(cache, prog, pc + 1, pc + 1 + ins->body, depth, log);
+            if (k < 0) return -1;
+            total += (k > 0 && ins->arg > UNDO_UNBOUNDED / k) ? UNDO_UNBOUNDED : k * ins->arg;
+            pc += ins->body;
+            continue;
+        }
+        if (ins->op != OP_EXEC || depth >= EXEC_MAX_DEPTH) continue; // слишком глубокий EXEC остановит скрипт
+        bool open_failed;
+        ExecEntry *sub = exec_cache_get(cache, prog->names[ins->arg], log, &open_failed);
+        if (!sub) return -1;
+        if (!sub->undos_known[depth + 1]) {
+            long long k = count_undo(cache, &sub->prog, 0, sub->prog.size, depth + 1, log);
+            if (k < 0) return -1;
+            sub->undos[depth + 1] = k; sub->undos_known[depth + 1] = true;
+        }
+        total += sub->undos[depth + 1];
+    }
+    return total < UNDO_UNBOUNDED ? total : UNDO_UNBOUNDED;
+}
+
+void exec_cache_free(ExecCache *cache) {
+    for (int i = 0; i < cache->size; i++) exec_entry_free(cache->entries[i]);
+    for (int i = 0; i < cache->nretired; i++) exec_entry_free(cache->retired[i]);
+    free(cache->entries); free(cache->retired);
+    memset(cache, 0, sizeof(*cache));
+}
+
+size_t history_bytes(History *hist) {
+    return (size_t)hist->csize * sizeof(CellChange) + (size_t)hist->ssize * sizeof(Step);
+}
+
+void profile_op(Profile *prof, OpCode op, long long t0) {
+    prof->op_count[op]++;
+    prof->op_us[op] += now_us() - t0;
+}
+
+// строка JSON с экранированием
+void json_str(FILE *f, const char *str) {
+    fputc('"', f);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(f, "\\%c", *p);
+        else if (*p < 0x20) fprintf(f, "\\u%04x", *p);
+        else fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+void profile_lines(FILE *f, Program *prog, bool *first) {
+    if (!prog->hits) return;
+    for (int l = 1; l <= prog->max_line; l++) {
+        if (!prog->hits[l] && !prog->taken[l]) continue;
+        fprintf(f, "%s\n    {\"file\": ", *first ? "" : ",");
+        json_str(f, prog->ctx);
+        fprintf(f, ", \"line\": %d, \"hits\": %lld, \"then\": %lld}", l, prog->hits[l], prog->taken[l]);
+        *first = false;
+    }
+}
+
+// отчет profile в JSON
+bool profile_write(const char *fname, Profile *prof, Program *prog, ExecCache *cache) {
+    FILE *f = fopen(fname, "w");
+    if (!f) return false;
+    fprintf(f, "{\n  \"ops\": [");
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!prof->op_count[op]) continue;
+        fprintf(f, "%s\n    {\"op\": \"%s\", \"count\": %lld, \"total_us\": %lld}", first ? "" : ",", op_names[op], prof->op_count[op], prof->op_us[op]);
+        first = false;
+    }
+    fprintf(f, "\n  ],\n");
+    fprintf(f, "  \"push_state\": {\"count\": %lld, \"total_us\": %lld},\n", prof->push_count, prof->push_us);
+    fprintf(f, "  \"pop_state\": {\"count\": %lld, \"total_us\": %lld},\n", prof->pop_count, prof->pop_us);
+    fprintf(f, "  \"render\": {\"count\": %lld, \"total_us\": %lld},\n", prof->render_count, prof->render_us);
+    fprintf(f, "  \"peak_history_bytes\": %zu,\n", prof->peak_history);
+    fprintf(f, "  \"max_depth\": %d,\n", prof->max_depth);
+    fprintf(f, "  \"lines\": [");
+    first = true;
+    profile_lines(f, prog, &first);
+    for (int i = 0; i < cache->size; i++) profile_lines(f, &cache->entries[i]->prog, &first);
+    for (int i = 0; i < cache->nretired; i++) profile_lines(f, &cache->retired[i]->prog, &first);
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// файл trace: "MDTR", версия, начальное поле двоичным снимком (как у save_binary), дальше записи:
+//   шаг: код команды (байт < OP_COUNT), номер файла, строка, сдвиг динозавра dx, dy, число клеток n,
+//        n раз: клетка относительно динозавра cx, cy, terrain, paint
+//   имя файла: TRACE_FILE, номер, длина, байты имени
+//   конец: TRACE_END
+// числа — varint, сдвиги — zigzag varint
+#define TRACE_MAGIC "MDTR"
+#define TRACE_VERSION 1
+#define TRACE_FILE 0x40
+#define TRACE_END 0xff
+#define TRACE_BUF (1 << 16)
+
+// знаковое число в беззнаковое: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+unsigned zigzag(int v) {
+    return (unsigned)v << 1 ^ (unsigned)(v >> 31);
+}
+
+int unzigzag(unsigned long long v) {
+    return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+void trace_flush(Trace *t) {
+    if (t->size > 0 && fwrite(t->buf, 1, t->size, t->f) != t->size) t->failed = true;
+    t->size = 0;
+}
+
+// свободное место в буфере под n байт (n <= TRACE_BUF)
+unsigned char *trace_reserve(Trace *t, size_t n) {
+    if (t->size + n > TRACE_BUF) trace_flush(t);
+    return t->buf + t->size;
+}
+
+bool trace_open(Trace *t, const char *fname, Grid *g, int x, int y) {
+    memset(t, 0, sizeof(*t));
+    t->f = fopen(fname, "wb");
+    if (!t->f) return false;
+    t->buf = malloc(TRACE_BUF);
+    if (!t->buf) { fclose(t->f); t->f = NULL; return false; }
+    t->px = x; t->py = y;
+    fwrite(TRACE_MAGIC, 1, 4, t->f);
+    fputc(TRACE_VERSION, t->f);
+    if (!save_binary(t->f, g, y, x)) t->failed = true;
+    return true;
+}
+
+// запись о выполненной команде вместе с изменениями клеток, накопленными с прошлой записи
+void trace_step(Trace *t, Program *prog, Instr *ins, int x, int y) {
+    if (prog->trace_id == 0) {
+        prog->trace_id = ++t->nfiles;
+        size_t len = strlen(prog->ctx);
+        unsigned char *p = trace_reserve(t, 21), *p0 = p;
+        *p++ = TRACE_FILE;
+        p = put_varint(p, prog->trace_id);
+        p = put_varint(p, len);
+        t->size += p - p0;
+        for (size_t done = 0; done < len; ) {
+            size_t k = len - done < TRACE_BUF ? len - done : TRACE_BUF;
+            memcpy(trace_reserve(t, k), prog->ctx + done, k);
+            t->size += k; done += k;
+        }
+    }
+    unsigned char *p = trace_reserve(t, 41), *p0 = p;
+    *p++ = (unsigned char)ins->op;
+    p = put_varint(p, prog->trace_id);
+    p = put_varint(p, ins->line);
+    p = put_varint(p, zigzag(x - t->px));
+    p = put_varint(p, zigzag(y - t->py));
+    p = put_varint(p, t->ncells);
+    t->size += p - p0;
+    for (int i = 0; i < t->ncells; i++) {
+        TraceCell *tc = &t->cells[i];
+        p = p0 = trace_reserve(t, 12);
+        p = put_varint(p, zigzag(tc->x - x));
+        p = put_varint(p, zigzag(tc->y - y));
+        *p++ = tc->c.terrain; *p++ = tc->c.paint;
+        t->size += p - p0;
+    }
+    t->ncells = 0;
+    t->px = x; t->py = y;
+    t->steps++;
+}
+
+// дописывает конец и закрывает файл; false, если что-то не записалось
+bool trace_close(Trace *t) {
+    *trace_reserve(t, 1) = TRACE_END; t->size++;
+    trace_flush(t);
+    bool ok = !t->failed;
+    if (fclose(t->f) != 0) ok = false;
+    free(t->buf); free(t->cells);
+    memset(t, 0, sizeof(*t));
+    return ok;
+}
+
+// k команд MOVE (dx, dy) подряд за одну операцию: по индексам ям и препятствий сразу видно,
+// сколько шагов свободно. Предупреждения, ошибка и шаги истории — как у отдельных команд
+bool move_run(Interp *in, int dx, int dy, long long k) {
+    Grid *g = &in->grid;
+    int len = dx != 0 ? g->width : g->height;
+    int obst = first_obstacle(g, in->x, in->y, dx, dy), pit = first_pit(g, in->x, in->y, dx, dy);
+    int stop = obst; // ближайшая клетка, на которую шагнуть нельзя
+    if (pit > 0 && (stop == 0 || pit < stop)) stop = pit;
+    long long free_steps = stop > 0 ? stop - 1 : k;
+    long long steps = free_steps < k ? free_steps : k;
+    if (!in->hist.off) {
+        for (long long i = 1; i <= steps; i++) push_state(&in->hist, wrap(in->x + dx * (int)(i % len), g->width), wrap(in->y + dy * (int)(i % len), g->height));
+    }
+    in->x = wrap(in->x + dx * (int)(steps % len), g->width);
+    in->y = wrap(in->y + dy * (int)(steps % len), g->height);
+    in->executed += steps;
+    if (steps == k) return true;
+    in->executed++;
+    if (stop == pit) { log_msg(in->log, "Error: stepped on pit\n"); return false; }
+    // динозавр уперся: каждая оставшаяся команда дает предупреждение и пустой шаг
+    for (long long i = steps; i < k; i++) {
+        log_msg(in->log, "Warning: cannot step on obstacle\n");
+        push_state(&in->hist, in->x, in->y);
+    }
+    in->executed += k - steps - 1;
+    return true;
+}
+
+// k одинаковых PAINT подряд: красит первая, остальные только добавляют шаги истории
+bool paint_run(Interp *in, char c, long long k) {
+    set_paint(&in->hist, &in->grid, in->x, in->y, c);
+    if (in->grid.oom) { log_msg(in->log, "Error: out of memory\n"); return false; }
+    if (!in->hist.off) for (long long i = 0; i < k; i++) push_state(&in->hist, in->x, in->y);
+    in->executed += k;
+    return true;
+}
+
+// серия из OP_FUSED (или одной MOVE/PAINT), повторенная times раз
+bool fused_run(Interp *in, Instr *ins, long long times) {
+    Instr *op = ins->op == OP_FUSED ? ins + 1 : ins;
+    long long k = (ins->op == OP_FUSED ? ins->arg : 1) * times;
+    if (k == 0) return true;
+    return op->op == OP_MOVE ? move_run(in, op->dx, op->dy, k) : paint_run(in, (char)op->arg, k);
+}
+
+// выполняет инструкции [begin, end)
+bool run_program(Interp *in, Program *prog, int begin, int end, int depth) {
+    Grid *g = &in->grid;
+    const char *ctx = prog->ctx;
+    Profile *prof = in->prof;
+    if (prof && !prog->hits) {
+        prog->hits = calloc(prog->max_line + 1, sizeof(long long));
+        prog->taken = calloc(prog->max_line + 1, sizeof(long long));
+        if (!prog->hits || !prog->taken) { log_msg(in->log, "Error: out of memory\n"); return false; }
+    }
+    if (prof && depth > prof->max_depth) prof->max_depth = depth;
+
+    for (int pc = begin; pc < end; pc++) {
+        Instr *ins = &prog->code[pc];
+        if (ins->op == OP_FUSED) {
+            // без fuse заголовок пропускается, и серия выполняется по одной команде
+            if (in->fuse) {
+                if (!fused_run(in, ins, 1)) return false;
+                pc += ins->body;
+            }
+            continue;
+        }
+        int dx = ins->dx, dy = ins->dy, lnum = ins->line;
+        in->executed++;
+        long long t0 = 0;
+        if (prof) {
+            t0 = now_us();
+            if (!ins->nested) prog->hits[lnum]++;
+        }
+        int nx = wrap(in->x + dx, g->width), ny = wrap(in->y + dy, g->height);
+        bool warning_issued = false;
+
+        switch (ins->op) {
+        case OP_UNDO:
+            pop_state(&in->hist, g, ins->arg, &in->x, &in->y);
+            if (prof) { prof->pop_count++; prof->pop_us += now_us() - t0; }
+            break;
+        case OP_REWIND: {
+            // шаг k — состояние после k-й команды текущей истории, 0 — после START/LOAD
+            int current = in->hist.ssize - 1;
+            if (ins->arg > current) {
+                log_msg(in->log, "Warning: cannot rewind forward to step %d (current step %d)\n", ins->arg, current);
+                warning_issued = true;
+            } else {
+                pop_state(&in->hist, g, current - ins->arg, &in->x, &in->y);
+            }
+            if (prof) { prof->pop_count++; prof->pop_us += now_us() - t0; }
+            break;
+        }
+        case OP_MOVE: {
+            char target_t = grid_at(g, nx, ny)->terrain;
+            if (target_t == '%') { log_msg(in->log, "Error: stepped on pit\n"); return false; }
+            else if (target_t == '^' || target_t == '&' || target_t == '@') {
+                log_msg(in->log, "Warning: cannot step on obstacle\n");
+                warning_issued = true;
+            }
+            else { in->x = nx; in->y = ny; }
+            break;
+        }
+        case OP_PAINT:
+            set_paint(&in->hist, g, in->x, in->y, (char)ins->arg);
+            break;
+        case OP_DIG:
+            if (grid_at(g, nx, ny)->terrain == '^') {
+                set_terrain(&in->hist, g, nx, ny, '_');
+            } else {
+                set_terrain(&in->hist, g, nx, ny, '%');
+            }
+            break;
+        case OP_MOUND:
+            if (grid_at(g, nx, ny)->terrain == '%') set_terrain(&in->hist, g, nx, ny, '_');
+            else set_terrain(&in->hist, g, nx, ny, '^');
+            break;
+        case OP_JUMP: {
+            // вместо шагов по одной клетке ищем первое препятствие по индексу
+            int len = dx != 0 ? g->width : g->height;
+            int steps = ins->arg;
+            if (g->rec) g->rec->failed = true;
+            int k = first_obstacle(g, in->x, in->y, dx, dy);
+            bool ignore_jump = false;
+            if (k > 0 && k <= steps) {
+                char next_t = grid_at_wrap(g, in->x + dx * k, in->y + dy * k)->terrain;
+                if (next_t == '^') {
+                    log_msg(in->log, "Warning: cannot jump over mound\n");
+                    steps = k - 1;
+                } else {
+                    log_msg(in->log, "Warning: cannot jump over obstacle\n");
+                    ignore_jump = true;
+                }
+                warning_issued = true;
+            }
+            int curr_x = wrap(in->x + dx * (steps % len), g->width);
+            int curr_y = wrap(in->y + dy * (steps % len), g->height);
+            if (!ignore_jump) {
+                char final_t = grid_at(g, curr_x, curr_y)->terrain;
+                if (final_t == '%') { log_msg(in->log, "Error: stepped on pit\n"); return false; }
+                in->x = curr_x; in->y = curr_y;
+            }
+            break;
+        }
+        case OP_GROW:
+            if (grid_at(g, nx, ny)->terrain != '_') {
+                log_msg(in->log, "Error: cannot grow tree on non-empty cell %s line %d\n", ctx, lnum);
+                return false;
+            }
+            set_terrain(&in->hist, g, nx, ny, '&');
+            break;
+        case OP_CUT:
+            if (grid_at(g, nx, ny)->terrain != '&') {
+                log_msg(in->log, "Error: no tree to cut %s line %d\n", ctx, lnum);
+                return false;
+            }
+            set_terrain(&in->hist, g, nx, ny, '_');
+            break;
+        case OP_MAKE:
+            if (grid_at(g, nx, ny)->terrain != '_') {
+                log_msg(in->log, "Error: cannot make stone on non-empty cell %s line %d\n", ctx, lnum);
+                return false;
+            }
+            set_terrain(&in->hist, g, nx, ny, '@');
+            break;
+        case OP_PUSH: {
+            if (grid_at(g, nx, ny)->terrain != '@') {
+                log_msg(in->log, "Error: no stone to push %s line %d\n", ctx, lnum);
+                return false;
+            }
+            int px = wrap(nx + dx, g->width); int py = wrap(ny + dy, g->height);
+            char tt = grid_at(g, px, py)->terrain;
+            if (tt == '^' || tt == '&' || tt == '@') {
+                log_msg(in->log, "Error: cannot push stone into obstacle %s line %d\n", ctx, lnum);
+                return false;
+            }
+            set_terrain(&in->hist, g, nx, ny, '_');
+            if (tt == '%') set_terrain(&in->hist, g, px, py, '_');
+            else set_terrain(&in->hist, g, px, py, '@');
+            in->x = nx;
+            in->y = ny;
+            break;
+        }
+        case OP_EXEC: {
+            const char *fname = prog->names[ins->arg];
+            if (g->rec && depth > g->rec->depth) g->rec->depth = depth;
+            if (depth >= EXEC_MAX_DEPTH) {
+                log_msg(in->log, "Error: nesting too deep %s line %d\n", ctx, lnum);
+                return false;
+            }
+            bool open_failed;
+            ExecEntry *sub = exec_cache_get(&in->exec_cache, fname, in->log, &open_failed);
+            if (!sub) {
+                if (open_failed) log_msg(in->log, "Error: cannot open exec file '%s' %s line %d\n", fname, ctx, lnum);
+                return false;
+            }
+            // запись о самом EXEC идет перед командами файла
+            if (g->trace) trace_step(g->trace, prog, ins, in->x, in->y);
+            sub->busy++;
+            bool ok;
+            Memo *hit = in->memo && !g->rec ? memo_find(g, sub, in->x, in->y, depth) : NULL;
+            if (hit) {
+                memo_apply(g, hit, &in->x, &in->y);
+                in->executed += hit->executed;
+                ok = true;
+            } else if (in->memo && !g->rec && sub->nmemo < MEMO_MAX && sub->memo_fails < MEMO_MAX) {
+                // записываем вызов; серии выполняются по одной команде, чтобы все чтения шли через grid_at.
+                // Вызов с сообщениями не сохраняется: при повторе их пришлось бы выводить заново
+                Memo rec = { .sx = in->x, .sy = in->y, .depth = depth };
+                int messages = in->log->count; long long executed = in->executed;
+                g->rec = &rec; in->fuse = false;
+                ok = run_program(in, &sub->prog, 0, sub->prog.size, depth + 1);
+                g->rec = NULL; in->fuse = true;
+                rec.dx = in->x - rec.sx; rec.dy = in->y - rec.sy;
+                rec.executed = in->executed - executed;
+                rec.depth -= depth;
+                memo_store(sub, &rec, ok && !rec.failed && !g->oom && in->log->count == messages);
+            } else {
+                ok = run_program(in, &sub->prog, 0, sub->prog.size, depth + 1);
+            }
+            sub->busy--;
+            if (!ok) return false;
+            break;
+        }
+        case OP_IF: {
+            int cx = wrap(dx, g->width), cy = wrap(dy, g->height);
+            if (g->rec) { g->rec->absolute = true; if (depth > g->rec->depth) g->rec->depth = depth; }
+            if (depth >= EXEC_MAX_DEPTH) {
+                log_msg(in->log, "Error: nesting too deep %s line %d\n", ctx, lnum);
+                return false;
+            }
+            char cell_sym = (cx == in->x && cy == in->y) ? '#' : cell_symbol(grid_at(g, cx, cy));
+            if (cell_sym == (char)ins->arg) {
+                if (prof) prog->taken[lnum]++;
+                if (g->trace) trace_step(g->trace, prog, ins, in->x, in->y);
+                // тело само сохраняет историю и рисует поле
+                if (!run_program(in, prog, pc + 1, pc + 1 + ins->body, depth + 1)) return false;
+                pc += ins->body;
+                if (prof) profile_op(prof, ins->op, t0);
+                continue;
+            }
+            pc += ins->body;
+            break;
+        }
+        case OP_REPEAT: {
+            if (g->trace) trace_step(g->trace, prog, ins, in->x, in->y);
+            Instr *first = &prog->code[pc + 1];
+            bool single = ins->body > 0 && (ins->body == 1 ? first->op == OP_MOVE || first->op == OP_PAINT
+                                                           : first->op == OP_FUSED && first->body == ins->body - 1);
+            if (in->fuse && single) {
+                // тело — одна серия: весь REPEAT одной операцией
+                if (!fused_run(in, first, ins->arg)) return false;
+            } else {
+                for (int k = 0; k < ins->arg; k++) {
+                    if (!run_program(in, prog, pc + 1, pc + 1 + ins->body, depth)) return false;
+                }
+            }
+            pc += ins->body;
+            if (prof) profile_op(prof, ins->op, t0);
+            continue;
+        }
+        case OP_FUSED:
+        case OP_COUNT:
+            break;
+        }
+        if (g->oom) { log_msg(in->log, "Error: out of memory\n"); return false; }
+        if (g->trace && ins->op != OP_EXEC) trace_step(g->trace, prog, ins, in->x, in->y);
+
+        if (!prof) {
+            if (ins->op != OP_UNDO && ins->op != OP_REWIND) push_state(&in->hist, in->x, in->y);
+            if (!warning_issued && in->display && in->interval_ms > 0) {
+                render_step(&in->render, g, in->x, in->y, in->log);
+            }
+            continue;
+        }
+
+        // то же самое с замерами
+        if (ins->op != OP_UNDO && ins->op != OP_REWIND) {
+            long long tp = now_us();
+            push_state(&in->hist, in->x, in->y);
+            prof->push_count++; prof->push_us += now_us() - tp;
+            size_t hb = history_bytes(&in->hist);
+            if (hb > prof->peak_history) prof->peak_history = hb;
+        }
+        if (!warning_issued && in->display && in->interval_ms > 0) {
+            long long tr = now_us();
+            render_step(&in->render, g, in->x, in->y, in->log);
+            prof->render_count++; prof->render_us += now_us() - tr;
+        }
+        profile_op(prof, ins->op, t0);
+    }
+    return true;
+}
+
+// настройки запуска из командной строки
+typedef struct {
+    bool display, save, check;
+    bool binary; // итоговое поле в двоичном снимке
+    bool bench;  // напечатать замеры производительности
+    const char *profile; // файл для отчета profile или NULL
+    const char *trace;   // файл trace или NULL
+    bool memo;           // запоминать результаты EXEC
+    int interval_ms;
+} Options;
+
+// один запуск: разбор input, выполнение и сохранение в output. 0 при успехе
+int run_job(const char *input, const char *output, const Options *opt, Log *log) {
+    long long t_start = now_us();
+    Source src; if (!source_open(&src, input)) { log_msg(log, "Error: cannot open '%s'\n", input); return 1; }
+
+    Interp in = {0}; in.display = opt->display; in.interval_ms = opt->interval_ms; in.log = log;
+    Grid *grid = &in.grid; int width = 0, height = 0, x = 0, y = 0;
+    bool size_set = false, start_set = false; int line_num = 0; char *line;
+    Program prog; program_init(&prog, input, log);
+
+    // сначала разбираем весь файл, выполнение начинается только если ошибок нет
+    while ((line = source_next(&src))) {
+        line_num = src.lnum;
+        if (line[0] == '\0') continue;
+        if (line[0] == '/' && line[1] == '/') continue;
+        if (line[0] == ' ') { log_msg(log, "Error: leading spaces at line %d\n", line_num); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+
+        if (!size_set) {
+            if (strncmp(line, "SIZE ", 5) != 0) { log_msg(log, "Error: first non-comment must be SIZE at line %d\n", line_num); program_free(&prog); source_close(&src); return 1; }
+            if (sscanf(line + 5, "%d %d", &width, &height) != 2 || width < 10 || width > MAX_SIZE || height < 10 || height > MAX_SIZE) {
+                log_msg(log, "Error: invalid SIZE (10-%d) at line %d\n", MAX_SIZE, line_num); program_free(&prog); source_close(&src); return 1;
+            }
+            size_set = true;
+            if (!grid_init(grid, width, height)) { cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+            continue;
+        }
+
+        if (!start_set) {
+            bool handled = false;
+            if (strncmp(line, "LOAD ", 5) == 0) {
+                if (!load_line(grid, line, &x, &y, line_num, log)) { cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+                start_set = true; handled = true;
+            } else if (strncmp(line, "START ", 6) == 0) {
+                if (sscanf(line + 6, "%d %d", &x, &y) != 2 || x < 0 || x >= width || y < 0 || y >= height) {
+                    log_msg(log, "Error: invalid START at line %d\n", line_num); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1;
+                }
+                start_set = true; handled = true;
+            }
+            if (!handled) { log_msg(log, "Error: LOAD/START expected at line %d\n", line_num); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+            continue;
+        }
+
+        if (strncmp(line, "SIZE ", 5) == 0 || strncmp(line, "START ", 6) == 0) { log_msg(log, "Error: repeated %s at line %d\n", strncmp(line, "SIZE ", 5) == 0 ? "SIZE" : "START", line_num); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+        if (strncmp(line, "LOAD ", 5) == 0) { log_msg(log, "Error: LOAD must be first at line %d\n", line_num); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+
+        if (!compile_line(&prog, line, line_num)) {
+            cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1;
+        }
+    }
+    if (src.oom) { log_msg(log, "Error: out of memory\n"); cleanup(&in.hist, grid); program_free(&prog); source_close(&src); return 1; }
+    source_close(&src);
+
+    if (!size_set) { log_msg(log, "Error: no SIZE\n"); program_free(&prog); return 1; }
+    if (!start_set) { log_msg(log, "Error: no START/LOAD\n"); cleanup(&in.hist, grid); program_free(&prog); return 1; }
+    if (!program_finish(&prog)) { cleanup(&in.hist, grid); program_free(&prog); return 1; }
+    if (opt->check) { cleanup(&in.hist, grid); program_free(&prog); return 0; } // только проверка синтаксиса
+
+    in.x = x; in.y = y;
+    // история нужна только для UNDO: без него не пишем ее вовсе, иначе храним столько шагов, сколько UNDO может откатить;
+    // ошибки в файлах EXEC здесь молчат — они будут выведены, если до этого EXEC дойдет выполнение
+    Log quiet = { .buffered = true };
+    long long undos = count_undo(&in.exec_cache, &prog, 0, prog.size, 0, &quiet);
+    log_free(&quiet);
+    for (int i = 0; i < in.exec_cache.size; i++) in.exec_cache.entries[i]->prog.log = log;
+    if (undos == 0) in.hist.off = true;
+    else if (undos > 0 && undos < (1 << 28)) in.hist.limit = (int)undos + 1;
+    Profile prof = {0};
+    if (opt->profile) in.prof = &prof;
+    Trace trace;
+    if (opt->trace) {
+        if (!trace_open(&trace, opt->trace, grid, x, y)) { log_msg(log, "Error: cannot open '%s'\n", opt->trace); cleanup(&in.hist, grid); program_free(&prog); return 1; }
+        grid->trace = &trace;
+    }
+    in.fuse = !opt->profile && !opt->trace && !(opt->display && opt->interval_ms > 0);
+    in.memo = opt->memo && in.fuse && in.hist.off;
+    push_state(&in.hist, x, y);
+    long long t_run = now_us();
+    if (opt->display) {
+        if (!renderer_init(&in.render, grid, opt->interval_ms)) { log_msg(log, "Error: out of memory\n"); cleanup(&in.hist, grid); program_free(&prog); return 1; }
+        render_frame(&in.render, grid, x, y, log);
+    }
+
+    bool ok = run_program(&in, &prog, 0, prog.size, 0);
+    long long t_done = now_us();
+    if (opt->profile && !profile_write(opt->profile, &prof, &prog, &in.exec_cache)) log_msg(log, "Warning: cannot open '%s'\n", opt->profile);
+    if (opt->trace) {
+        grid->trace = NULL;
+        if (!trace_close(&trace)) log_msg(log, "Warning: cannot write trace '%s'\n", opt->trace);
+    }
+    exec_cache_free(&in.exec_cache);
+    if (opt->display) {
+        if (ok && in.render.skipped) render_frame(&in.render, grid, in.x, in.y, log); // последний кадр был пропущен
+        renderer_free(&in.render);
+    }
+    if (!ok) {
+        cleanup(&in.hist, grid); program_free(&prog); return 1;
+    }
+
+    if (opt->save) {
+        if (!save_field(output, grid, in.y, in.x, opt->binary)) log_msg(log, "Warning: cannot open '%s'\n", output);
+    }
+    long long t_saved = now_us();
+
+    if (opt->bench) {
+        double run_s = (t_done - t_run) / 1e6;
+        size_t hist_bytes = history_bytes(&in.hist);
+        log_msg(log, "bench: commands=%lld parse_ms=%.3f run_ms=%.3f cmds_per_sec=%.0f peak_rss_kb=%ld history_bytes=%zu history_bytes_per_cmd=%.2f write_ms=%.3f\n",
+                in.executed, (t_run - t_start) / 1e3, run_s * 1e3, run_s > 0 ? in.executed / run_s : 0.0, peak_rss_kb(),
+                hist_bytes, in.executed ? (double)hist_bytes / in.executed : 0.0, (t_saved - t_done) / 1e3);
+    }
+
+    cleanup(&in.hist, grid); program_free(&prog);
+    return 0;
+}
+
+// задание пакетного режима
+typedef struct {
+    char *input, *output;
+    Log log;
+    int status;
+} BatchJob;
+
+// общая очередь заданий; каждый поток берет следующий номер, остальное у задания свое
+typedef struct {
+    BatchJob *jobs; int njobs;
+    Options opt;
+    atomic_int next;
+} BatchQueue;
+
+#ifdef _WIN32
+DWORD WINAPI batch_worker(LPVOID arg) {
+#else
+void *batch_worker(void *arg) {
+#endif
+    BatchQueue *q = arg;
+    int k;
+    while ((k = atomic_fetch_add(&q->next, 1)) < q->njobs) {
+        BatchJob *job = &q->jobs[k];
+        job->log.buffered = true;
+        job->status = run_job(job->input, job->output, &q->opt, &job->log);
+    }
+    return 0;
+}
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si; GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#ifdef _WIN32
+typedef DWORD (WINAPI *WorkerFn)(LPVOID);
+#else
+typedef void *(*WorkerFn)(void *);
+#endif
+
+// запускает threads потоков fn(arg) и ждет их; если потоки не создаются — выполняет fn сам
+void run_workers(WorkerFn fn, void *arg, int threads) {
+#ifdef _WIN32
+    HANDLE *tids = malloc(threads * sizeof(HANDLE));
+#else
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+#endif
+    int started = 0;
+    for (; tids && started < threads; started++) {
+#ifdef _WIN32
+        tids[started] = CreateThread(NULL, 0, fn, arg, 0, NULL);
+        if (!tids[started]) break;
+#else
+        if (pthread_create(&tids[started], NULL, fn, arg) != 0) break;
+#endif
+    }
+    if (started == 0) fn(arg); // потоков нет — выполняем сами
+    for (int t = 0; t < started; t++) {
+#ifdef _WIN32
+        WaitForSingleObject(tids[t], INFINITE); CloseHandle(tids[t]);
+#else
+        pthread_join(tids[t], NULL);
+#endif
+    }
+    free(tids);
+}
+
+// пакетный режим: манифест из строк "input output", задания выполняются параллельно
+int run_batch(const char *manifest, int threads, const Options *opt) {
+    Source src; if (!source_open(&src, manifest)) { printf("Error: cannot open '%s'\n", manifest); return 1; }
+    BatchQueue q = {0}; q.opt = *opt;
+    int cap = 0; char *line;
+    while ((line = source_next(&src))) {
+        if (line[0] == '\0' || (line[0] == '/' && line[1] == '/')) continue;
+        int is = -1, ie = -1, os = -1, oe = -1; char extra[2];
+        sscanf(line, " %n%*s%n %n%*s%n", &is, &ie, &os, &oe);
+        if (oe < 0 || sscanf(line + oe, "%1s", extra) == 1) {
+            printf("Error: invalid manifest line %s line %d\n", manifest, src.lnum);
+            for (int k = 0; k < q.njobs; k++) { free(q.jobs[k].input); free(q.jobs[k].output); }
+            free(q.jobs); source_close(&src); return 1;
+        }
+        if (q.njobs == cap) {
+            cap = cap ? cap * 2 : 64;
+            BatchJob *nj = realloc(q.jobs, cap * sizeof(BatchJob));
+            if (!nj) { printf("Error: out of memory\n"); source_close(&src); return 1; }
+            q.jobs = nj;
+        }
+        BatchJob *job = &q.jobs[q.njobs++];
+        memset(job, 0, sizeof(*job));
+        job->input = malloc(ie - is + 1); job->output = malloc(oe - os + 1);
+        if (!job->input || !job->output) { printf("Error: out of memory\n"); source_close(&src); return 1; }
+        memcpy(job->input, line + is, ie - is); job->input[ie - is] = '\0';
+        memcpy(job->output, line + os, oe - os); job->output[oe - os] = '\0';
+    }
+    if (src.oom) {
+        printf("Error: out of memory\n");
+        for (int k = 0; k < q.njobs; k++) { free(q.jobs[k].input); free(q.jobs[k].output); }
+        free(q.jobs); source_close(&src); return 1;
+    }
+    source_close(&src);
+
+    if (threads <= 0) threads = cpu_count();
+    if (threads > q.njobs) threads = q.njobs > 0 ? q.njobs : 1;
+    atomic_init(&q.next, 0);
+    run_workers(batch_worker, &q, threads);
+
+    // отчет в порядке манифеста: итог задания и его сообщения
+    int failed = 0;
+    for (int k = 0; k < q.njobs; k++) {
+        BatchJob *job = &q.jobs[k];
+        printf("%s: %s\n", job->input, job->status == 0 ? "ok" : "failed");
+        if (job->log.size > 0) fwrite(job->log.buf, 1, job->log.size, stdout);
+        if (job->status != 0) failed++;
+        log_free(&job->log); free(job->input); free(job->output);
+    }
+    printf("%d jobs, %d failed\n", q.njobs, failed);
+    free(q.jobs);
+    return failed ? 1 : 0;
+}
+
+// поле ансамбля: то, что у отдельного запуска лежит в Interp
+typedef struct {
+    char *output;
+    Grid grid; int x, y;
+    History hist;
+    Log log;
+    bool failed;
+} Board;
+
+// сколько инструкций занимает команда верхнего уровня вместе с телом
+int instr_span(const Program *prog, int pc, bool fuse) {
+    const Instr *ins = &prog->code[pc];
+    if (ins->op == OP_IF || ins->op == OP_REPEAT || (ins->op == OP_FUSED && fuse)) return 1 + ins->body;
+    return 1;
+}
+
+// разбор скрипта для режимов ensemble и solve: SIZE, необязательная строка START/LOAD
+// (копия в *start, NULL — ее нет, освобождает вызывающий) и команды в prog. Ошибки печатаются в stdout
+bool parse_script(const char *script, Program *prog, Log *log, int *width, int *height, char **start) {
+    Source src; if (!source_open(&src, script)) { printf("Error: cannot open '%s'\n", script); return false; }
+    program_init(prog, script, log);
+    bool size_set = false; char *line;
+    *start = NULL;
+    while ((line = source_next(&src))) {
+        int line_num = src.lnum;
+        if (line[0] == '\0' || (line[0] == '/' && line[1] == '/')) continue;
+        if (line[0] == ' ') { printf("Error: leading spaces at line %d\n", line_num); program_free(prog); free(*start); source_close(&src); return false; }
+        if (!size_set) {
+            if (strncmp(line, "SIZE ", 5) != 0) { printf("Error: first non-comment must be SIZE at line %d\n", line_num); program_free(prog); free(*start); source_close(&src); return false; }
+            if (sscanf(line + 5, "%d %d", width, height) != 2 || *width < 10 || *width > MAX_SIZE || *height < 10 || *height > MAX_SIZE) {
+                printf("Error: invalid SIZE (10-%d) at line %d\n", MAX_SIZE, line_num); program_free(prog); free(*start); source_close(&src); return false;
+            }
+            size_set = true;
+            continue;
+        }
+        bool is_start = strncmp(line, "START ", 6) == 0, is_load = strncmp(line, "LOAD ", 5) == 0;
+        if (!*start && prog->size == 0 && (is_start || is_load)) {
+            *start = malloc(strlen(line) + 1);
+            if (!*start) { printf("Error: out of memory\n"); program_free(prog); source_close(&src); return false; }
+            strcpy(*start, line);
+            continue;
+        }
+        if (strncmp(line, "SIZE ", 5) == 0 || is_start) { printf("Error: repeated %s at line %d\n", is_start ? "START" : "SIZE", line_num); program_free(prog); free(*start); source_close(&src); return false; }
+        if (is_load) { printf("Error: LOAD must be first at line %d\n", line_num); program_free(prog); free(*start); source_close(&src); return false; }
+        if (!compile_line(prog, line, line_num)) { program_free(prog); free(*start); source_close(&src); return false; }
+    }
+    if (src.oom) { printf("Error: out of memory\n"); program_free(prog); free(*start); source_close(&src); return false; }
+    source_close(&src);
+    if (!size_set) { printf("Error: no SIZE\n"); program_free(prog); free(*start); return false; }
+    if (!program_finish(prog)) { program_free(prog); free(*start); return false; }
+    return true;
+}
+
+// режим ансамбля: скрипт разбирается один раз и выполняется на многих полях сразу.
+// Поля идут по командам верхнего уровня в ногу: команда (и ее файл EXEC) разбирается и
+// попадает в кэш один раз для всех полей; ошибка останавливает только свое поле
+int run_ensemble(const char *script, const char *boards_file, const Options *opt) {
+    long long t_start = now_us();
+    Log log = {0};
+    Program prog; int width = 0, height = 0; char *start, *line;
+    // START/LOAD скрипта, если есть, заменяется началом каждого поля
+    if (!parse_script(script, &prog, &log, &width, &height, &start)) return 1;
+    free(start);
+
+    // поля: строки "START x y output" или "LOAD field output"
+    Source src;
+    if (!source_open(&src, boards_file)) { printf("Error: cannot open '%s'\n", boards_file); program_free(&prog); return 1; }
+    Board *boards = NULL; int nboards = 0, cap = 0; bool bad = false;
+    while (!bad && (line = source_next(&src))) {
+        if (line[0] == '\0' || (line[0] == '/' && line[1] == '/')) continue;
+        // имена файлов любой длины: слова копируются token_dup
+        char *arg = NULL, *out = NULL; int x = 0, y = 0, at = -1, end = 0;
+        bool is_load = strncmp(line, "LOAD ", 5) == 0;
+        if (is_load) { arg = token_dup(line + 5, &end); at = 5 + end; }
+        else if (sscanf(line, "START %d %d%n", &x, &y, &at) != 2) at = -1;
+        if (at >= 0 && (!is_load || arg)) out = token_dup(line + at, &end);
+        if ((is_load && !arg) || (at >= 0 && !out)) { printf("Error: out of memory\n"); free(arg); bad = true; break; }
+        if (at < 0 || (arg && arg[0] == '\0') || out[0] == '\0' || line[at + end + strspn(line + at + end, " \t")] != '\0') {
+            printf("Error: invalid board line %s line %d\n", boards_file, src.lnum); free(arg); free(out); bad = true; break;
+        }
+        if (nboards == cap) {
+            int ncap = cap ? cap * 2 : 64;
+            Board *nb = realloc(boards, ncap * sizeof(Board));
+            if (!nb) { printf("Error: out of memory\n"); free(arg); free(out); bad = true; break; }
+            boards = nb; cap = ncap;
+        }
+        Board *b = &boards[nboards++];
+        memset(b, 0, sizeof(*b));
+        b->log.buffered = true;
+        b->output = out;
+        if (!grid_init(&b->grid, width, height)) { printf("Error: out of memory\n"); free(arg); bad = true; break; }
+        if (is_load) {
+            if (!load_field(&b->grid, arg, &x, &y, src.lnum, &b->log)) b->failed = true;
+            free(arg);
+        } else if (x < 0 || x >= width || y < 0 || y >= height) {
+            log_msg(&b->log, "Error: invalid START at line %d\n", src.lnum); b->failed = true;
+        }
+        b->x = x; b->y = y;
+    }
+    if (!bad && src.oom) { printf("Error: out of memory\n"); bad = true; }
+    source_close(&src);
+
+    int failed = 0;
+    long long executed = 0, t_run = 0, t_done = 0;
+    if (!bad && !opt->check) {
+        // общие для всех полей: программа, кэш EXEC и решение об истории
+        Interp in = {0}; in.log = &log; in.fuse = true;
+        Log quiet = { .buffered = true };
+        long long undos = count_undo(&in.exec_cache, &prog, 0, prog.size, 0, &quiet);
+        log_free(&quiet);
+        in.memo = opt->memo && undos == 0;
+        for (int k = 0; k < nboards; k++) {
+            History *h = &boards[k].hist;
+            if (undos == 0) h->off = true;
+            else if (undos > 0 && undos < (1 << 28)) h->limit = (int)undos + 1;
+            if (!boards[k].failed) push_state(h, boards[k].x, boards[k].y);
+        }
+        t_run = now_us();
+        for (int pc = 0; pc < prog.size; ) {
+            int span = instr_span(&prog, pc, in.fuse);
+            for (int k = 0; k < nboards; k++) {
+                Board *b = &boards[k];
+                if (b->failed) continue;
+                in.grid = b->grid; in.x = b->x; in.y = b->y; in.hist = b->hist; in.log = &b->log;
+                for (int i = 0; i < in.exec_cache.size; i++) in.exec_cache.entries[i]->prog.log = &b->log;
+                if (!run_program(&in, &prog, pc, pc + span, 0)) b->failed = true;
+                b->grid = in.grid; b->x = in.x; b->y = in.y; b->hist = in.hist;
+            }
+            pc += span;
+        }
+        t_done = now_us();
+        executed = in.executed;
+        exec_cache_free(&in.exec_cache);
+
+        for (int k = 0; k < nboards; k++) {
+            Board *b = &boards[k];
+            if (!b->failed && opt->save && !save_field(b->output, &b->grid, b->y, b->x, opt->binary)) log_msg(&b->log, "Warning: cannot open '%s'\n", b->output);
+        }
+    }
+
+    // отчет в порядке списка полей, как в пакетном режиме
+    for (int k = 0; k < nboards; k++) {
+        Board *b = &boards[k];
+        if (!bad) {
+            printf("%s: %s\n", b->output, b->failed ? "failed" : "ok");
+            if (b->log.size > 0) fwrite(b->log.buf, 1, b->log.size, stdout);
+            if (b->failed) failed++;
+        }
+        cleanup(&b->hist, &b->grid); log_free(&b->log); free(b->output);
+    }
+    if (!bad) printf("%d boards, %d failed\n", nboards, failed);
+    if (!bad && !opt->check && opt->bench) {
+        double run_s = (t_done - t_run) / 1e6;
+        printf("bench: boards=%d commands=%lld parse_ms=%.3f run_ms=%.3f cmds_per_sec=%.0f peak_rss_kb=%ld\n",
+               nboards, executed, (t_run - t_start) / 1e3, run_s * 1e3, run_s > 0 ? executed / run_s : 0.0, peak_rss_kb());
+    }
+    free(boards); program_free(&prog);
+    return bad || failed ? 1 : 0;
+}
+
+// режим solve: поиск в ширину кратчайшей последовательности MOVE/JUMP/PUSH до клетки цели
+// по тем же правилам, что в run_program. Состояние — позиция динозавра и клетки, которые
+// изменили PUSH (отличия от начального поля); уровни поиска раскрываются параллельно
+#define SOLVE_CHUNK 64 // состояний уровня на одну порцию работы потока
 
+// клетка, измененная PUSH
 typedef struct {
-    char **terrain;
-    char **paint;
     int x, y;
-} State;
+    char t;
+} SolveCell;
 
-// для очистки терминала
-void clear_screen() {
-#ifdef _WIN32
-    system("cls");
-#else
-    system("clear"); // clear в винде тоже работает
-#endif
+typedef struct {
+    int x, y;
+    int cells, ncells;        // отличия от начального поля в пуле, по y, затем по x
+    unsigned long long fhash; // хэш отличий: сумма хэшей клеток
+    int parent;               // состояние, из которого пришли, -1 у начального
+    OpCode op; int dx, dy, arg; // команда из parent
+} SolveState;
+
+// состояние, найденное потоком; local — отличия в пуле порции, -1 — как у родителя
+typedef struct {
+    SolveState st;
+    int local;
+} SolveKid;
+
+// результат одной порции
+typedef struct {
+    SolveKid *kids; int nkids, kcap;
+    SolveCell *pool; int npool, pcap;
+    int done;                 // следующее нераскрытое состояние порции: поток останавливается у предела max-states
+    bool oom;
+} SolveChunk;
+
+typedef struct {
+    Grid *g;                       // начальное поле, только чтение
+    SolveState *states; int nstates, scap;
+    SolveCell *pool; int npool, pcap;
+    int *table; int tsize;         // открытая адресация по номерам состояний, -1 — пусто
+    int level_begin, level_end;    // раскрываемый уровень
+    SolveChunk *chunks; int nchunks, ccap;
+    atomic_int next;
+    atomic_int pending;            // сколько соседей нашли потоки на этом уровне (с повторами)
+    long long max_states;
+} Solver;
+
+unsigned long long solve_cell_hash(int x, int y, char t) {
+    return mix64((unsigned long long)y << 20 | (unsigned)x | (unsigned long long)(unsigned char)t << 40);
 }
 
-// для вывода поля
-void print_field(FILE *out, char **terrain, char **paint, int y, int x, int height, int width, bool to_file) {
-    /*
+unsigned long long solve_hash(const SolveState *st) {
+    return mix64(((unsigned long long)st->y << 20 | (unsigned)st->x) + st->fhash);
+}
 
-    */
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            char c;
-            if (i == y && j == x) {
-                c = '#';
-            } else if (terrain[i][j] == '_' && paint[i][j] != '\0') {
-                c = paint[i][j];
-            } else {
-                c = terrain[i][j];
-            }
-            if (to_file) {
-                fprintf(out, "%c ", c);
-            } else {
-                printf("%c ", c);
+// объект клетки в состоянии с отличиями cells
+char solve_terrain(Solver *sv, const SolveCell *cells, int n, int x, int y) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cells[mid].y < y || (cells[mid].y == y && cells[mid].x < x)) lo = mid + 1; else hi = mid;
+    }
+    if (lo < n && cells[lo].x == x && cells[lo].y == y) return cells[lo].t;
+    return grid_at(sv->g, x, y)->terrain;
+}
+
+// ставит клетку в отсортированный список отличий (места в v хватает на еще одну);
+// совпадение с начальным полем убирает клетку из списка. Возвращает новую длину
+int solve_set(Solver *sv, SolveCell *v, int n, int x, int y, char t, unsigned long long *fhash) {
+    int i = 0;
+    while (i < n && (v[i].y < y || (v[i].y == y && v[i].x < x))) i++;
+    bool found = i < n && v[i].x == x && v[i].y == y;
+    if (found) {
+        *fhash -= solve_cell_hash(x, y, v[i].t);
+        memmove(v + i, v + i + 1, (n - i - 1) * sizeof(SolveCell));
+        n--;
+    }
+    if (t == grid_at(sv->g, x, y)->terrain) return n;
+    memmove(v + i + 1, v + i, (n - i) * sizeof(SolveCell));
+    v[i].x = x; v[i].y = y; v[i].t = t;
+    *fhash += solve_cell_hash(x, y, t);
+    return n + 1;
+}
+
+// номер такого же состояния или -1
+int solve_find(Solver *sv, const SolveState *st, const SolveCell *cells) {
+    for (int h = (int)(solve_hash(st) & (sv->tsize - 1));; h = (h + 1) & (sv->tsize - 1)) {
+        int i = sv->table[h];
+        if (i < 0) return -1;
+        SolveState *o = &sv->states[i];
+        if (o->x != st->x || o->y != st->y || o->ncells != st->ncells || o->fhash != st->fhash) continue;
+        const SolveCell *oc = sv->pool + o->cells;
+        int k = 0;
+        while (k < st->ncells && oc[k].x == cells[k].x && oc[k].y == cells[k].y && oc[k].t == cells[k].t) k++;
+        if (k == st->ncells) return i;
+    }
+}
+
+void solve_insert(Solver *sv, int idx) {
+    int h = (int)(solve_hash(&sv->states[idx]) & (sv->tsize - 1));
+    while (sv->table[h] >= 0) h = (h + 1) & (sv->tsize - 1);
+    sv->table[h] = idx;
+}
+
+// добавляет соседа в порцию, если такого состояния еще нет среди найденных
+void solve_kid(Solver *sv, SolveChunk *c, const SolveState *st, const SolveCell *cells, int local) {
+    if (solve_find(sv, st, cells) >= 0) return;
+    if (c->nkids == c->kcap) {
+        int ncap = c->kcap ? c->kcap * 2 : 256;
+        SolveKid *nk = realloc(c->kids, ncap * sizeof(SolveKid));
+        if (!nk) { c->oom = true; return; }
+        c->kids = nk; c->kcap = ncap;
+    }
+    c->kids[c->nkids].st = *st;
+    c->kids[c->nkids++].local = local;
+}
+
+// все соседи состояния si: MOVE, JUMP на 2..len-1 клеток до первого препятствия, PUSH
+void solve_expand(Solver *sv, SolveChunk *c, int si) {
+    const SolveState *s = &sv->states[si];
+    const SolveCell *cells = sv->pool + s->cells;
+    Grid *g = sv->g;
+    static const int dxs[4] = {0, 0, -1, 1}, dys[4] = {-1, 1, 0, 0};
+    for (int d = 0; d < 4; d++) {
+        int dx = dxs[d], dy = dys[d];
+        SolveState kid = *s;
+        kid.parent = si; kid.dx = dx; kid.dy = dy; kid.arg = 0;
+        int nx = wrap(s->x + dx, g->width), ny = wrap(s->y + dy, g->height);
+        char t = solve_terrain(sv, cells, s->ncells, nx, ny);
+        if (t != '%' && !is_obstacle(t)) {
+            kid.op = OP_MOVE; kid.x = nx; kid.y = ny;
+            solve_kid(sv, c, &kid, cells, -1);
+        }
+        if (t == '@') {
+            int px = wrap(nx + dx, g->width), py = wrap(ny + dy, g->height);
+            char tt = solve_terrain(sv, cells, s->ncells, px, py);
+            if (!is_obstacle(tt)) {
+                if (c->npool + s->ncells + 2 > c->pcap) {
+                    int ncap = c->pcap ? c->pcap * 2 : 1024;
+                    while (ncap < c->npool + s->ncells + 2) ncap *= 2;
+                    SolveCell *np = realloc(c->pool, ncap * sizeof(SolveCell));
+                    if (!np) { c->oom = true; return; }
+                    c->pool = np; c->pcap = ncap;
+                }
+                SolveCell *v = c->pool + c->npool;
+                if (s->ncells > 0) memcpy(v, cells, s->ncells * sizeof(SolveCell));
+                kid.fhash = s->fhash;
+                int n = solve_set(sv, v, s->ncells, nx, ny, '_', &kid.fhash);
+                n = solve_set(sv, v, n, px, py, tt == '%' ? '_' : '@', &kid.fhash);
+                kid.op = OP_PUSH; kid.x = nx; kid.y = ny; kid.ncells = n;
+                int before = c->nkids;
+                solve_kid(sv, c, &kid, v, c->npool);
+                if (c->nkids > before) c->npool += n;
+                kid.fhash = s->fhash; kid.ncells = s->ncells;
             }
         }
-        if (to_file) {
-            fprintf(out, "\n");
-        } else {
-            printf("\n");
+        if (is_obstacle(t)) continue;
+        // JUMP дальше первого препятствия не уходит: у горы прыжок укорачивается, у остальных отменяется
+        int len = dx != 0 ? g->width : g->height;
+        kid.op = OP_JUMP;
+        for (int k = 2; k < len; k++) {
+            int cx = wrap(s->x + dx * k, g->width), cy = wrap(s->y + dy * k, g->height);
+            char ct = solve_terrain(sv, cells, s->ncells, cx, cy);
+            if (is_obstacle(ct)) break;
+            if (ct == '%') continue;
+            kid.x = cx; kid.y = cy; kid.arg = k;
+            solve_kid(sv, c, &kid, cells, -1);
         }
     }
-    if (to_file) {
-        fprintf(out, "\n");
-    } else {
-        printf("\n");
+}
+
+#ifdef _WIN32
+DWORD WINAPI solve_worker(LPVOID arg) {
+#else
+void *solve_worker(void *arg) {
+#endif
+    Solver *sv = arg;
+    int k;
+    while ((k = atomic_fetch_add(&sv->next, 1)) < sv->nchunks) {
+        SolveChunk *c = &sv->chunks[k];
+        int end = sv->level_begin + (k + 1) * SOLVE_CHUNK;
+        if (end > sv->level_end) end = sv->level_end;
+        for (c->done = sv->level_begin + k * SOLVE_CHUNK; c->done < end && !c->oom; c->done++) {
+            // уровень уже дал не меньше соседей, чем осталось до предела: остальное раскроет слияние, если понадобится
+            if (sv->nstates + (long long)atomic_load(&sv->pending) >= sv->max_states) break;
+            int before = c->nkids;
+            solve_expand(sv, c, c->done);
+            atomic_fetch_add(&sv->pending, c->nkids - before);
+        }
     }
+    return 0;
 }
 
-// сохраняем историю
-void push_state(State **history, int *size, int *cap, char **terr, char **pai, int px, int py, int hh, int ww) {
-    if (*size == *cap) {
-        *cap = *cap ? *cap * 2 : 16;
-        *history = realloc(*history, *cap * sizeof(State)); // увеличить размер массива
-        if (!*history) return; // мягкий выход
+// добавляет состояние в найденные; cells копируются в пул, NULL — st->cells уже указывает
+// на отличия в пуле (как у родителя). false — нет памяти
+bool solve_add(Solver *sv, const SolveState *st, const SolveCell *cells) {
+    if (sv->nstates == sv->scap) {
+        int ncap = sv->scap ? sv->scap * 2 : 1024;
+        SolveState *ns = realloc(sv->states, ncap * sizeof(SolveState));
+        if (!ns) return false;
+        sv->states = ns; sv->scap = ncap;
+    }
+    if (cells && sv->npool + st->ncells > sv->pcap) {
+        int ncap = sv->pcap ? sv->pcap * 2 : 1024;
+        while (ncap < sv->npool + st->ncells) ncap *= 2;
+        SolveCell *np = realloc(sv->pool, ncap * sizeof(SolveCell));
+        if (!np) return false;
+        sv->pool = np; sv->pcap = ncap;
     }
-    State *ns = &(*history)[*size]; // 2Д массивы с препятствиями, отдельный с цветами, координаты текущей позиции
-    ns->terrain = malloc(hh * sizeof(char *));
-    if (!ns->terrain) return;
-    for (int i = 0; i < hh; i++) {
-        ns->terrain[i] = malloc(ww);
-        if (!ns->terrain[i]) { return; }
-        memcpy(ns->terrain[i], terr[i], ww);
+    if ((sv->nstates + 1) * 2 > sv->tsize) {
+        int nsize = sv->tsize ? sv->tsize * 2 : 4096;
+        int *nt = malloc(nsize * sizeof(int));
+        if (!nt) return false;
+        free(sv->table);
+        sv->table = nt; sv->tsize = nsize;
+        for (int i = 0; i < nsize; i++) nt[i] = -1;
+        for (int i = 0; i < sv->nstates; i++) solve_insert(sv, i);
     }
-    ns->paint = malloc(hh * sizeof(char *));
-    if (!ns->paint) return;
-    for (int i = 0; i < hh; i++) {
-        ns->paint[i] = malloc(ww);
-        if (!ns->paint[i]) return;
-        memcpy(ns->paint[i], pai[i], ww);
+    SolveState *s = &sv->states[sv->nstates];
+    *s = *st;
+    if (cells) {
+        s->cells = sv->npool;
+        memcpy(sv->pool + sv->npool, cells, st->ncells * sizeof(SolveCell));
+        sv->npool += st->ncells;
     }
-    ns->x = px; ns->y = py;
-    (*size)++;
+    solve_insert(sv, sv->nstates++);
+    return true;
 }
 
-// undo
-void pop_state(State **history, int *size, char ***terr, char ***pai, int *px, int *py, int hh, int ww) {
-    /*
-    1 Если история пуста или одна запись — выход.
-    2 Уменьшает размер истории.
-    3 Освобождает текущие массивы terr и pai.
-    4 Выделяет новые массивы для terr и pai, копирует данные из предыдущего состояния (prev).
-    5 Обновляет координаты px и py из prev.
-    6 Освобождает копии массивов в prev, обнуляет указатели.
-    */
+void solver_free(Solver *sv) {
+    for (int i = 0; i < sv->ccap; i++) { free(sv->chunks[i].kids); free(sv->chunks[i].pool); }
+    free(sv->chunks); free(sv->states); free(sv->pool); free(sv->table);
+}
+
+// режим solve: поле — результат скрипта input, ответ — скрипт output: input и найденные команды
+int run_solve(const char *input, const char *output, int gx, int gy, int threads, long long max_states) {
+    Log log = {0};
+    Program prog; int width = 0, height = 0; char *start;
+    if (!parse_script(input, &prog, &log, &width, &height, &start)) return 1;
+    if (!start) { printf("Error: no START/LOAD\n"); program_free(&prog); return 1; }
+    if (gx < 0 || gx >= width || gy < 0 || gy >= height) { printf("Error: goal outside the field\n"); program_free(&prog); free(start); return 1; }
 
-    if (*size <= 1) return;
-    (*size)--;
-    State *prev = &(*history)[*size];
-    // освободили память для текущего
-    for (int i = 0; i < hh; i++) {
-        free((*terr)[i]);
-        free((*pai)[i]);
-    }
-    free(*terr); free(*pai);
-
-    
-    // Восстановили предыдущий
-    *terr = malloc(hh * sizeof(char *));
-    if (!*terr) return;
-    for (int i = 0; i < hh; i++) {
-        (*terr)[i] = malloc(ww);
-        if (!(*terr)[i]) { return; }
-        memcpy((*terr)[i], prev->terrain[i], ww);
-    }
-    *pai = malloc(hh * sizeof(char *));
-    if (!*pai) return;
-    for (int i = 0; i < hh; i++) {
-        (*pai)[i] = malloc(ww);
-        if (!(*pai)[i]) return;
-        memcpy((*pai)[i], prev->paint[i], ww);
+    // начальное поле: START/LOAD и команды скрипта
+    Interp in = {0}; in.log = &log; in.fuse = true;
+    bool ok = grid_init(&in.grid, width, height);
+    if (!ok) printf("Error: out of memory\n");
+    else if (start[0] == 'S') {
+        ok = sscanf(start + 6, "%d %d", &in.x, &in.y) == 2 && in.x >= 0 && in.x < width && in.y >= 0 && in.y < height;
+        if (!ok) printf("Error: invalid START\n");
+    } else {
+        ok = load_line(&in.grid, start, &in.x, &in.y, 0, &log);
     }
-    *px = prev->x; *py = prev->y;
-    // Free prev copy
-    for (int i = 0; i < hh; i++) { free(prev->terrain[i]); free(prev->paint[i]); }
-    free(prev->terrain); free(prev->paint);
-    prev->terrain = NULL; prev->paint = NULL;
-}
+    free(start);
+    if (ok) {
+        Log quiet = { .buffered = true };
+        in.hist.off = count_undo(&in.exec_cache, &prog, 0, prog.size, 0, &quiet) == 0;
+        log_free(&quiet);
+        for (int i = 0; i < in.exec_cache.size; i++) in.exec_cache.entries[i]->prog.log = &log;
+        push_state(&in.hist, in.x, in.y);
+        ok = run_program(&in, &prog, 0, prog.size, 0);
+    }
+    exec_cache_free(&in.exec_cache);
+    program_free(&prog);
+    if (!ok) { cleanup(&in.hist, &in.grid); return 1; }
 
-// очистка истории
-void cleanup(State **history, int *hsize, char ***terrain, char ***paint, int height) {
-    if (*terrain) {
-        for (int i = 0; i < height; i++) { free((*terrain)[i]); free((*paint)[i]); }
-        free(*terrain); free(*paint);
-        *terrain = NULL; *paint = NULL;
+    Solver sv = {0};
+    sv.g = &in.grid;
+    sv.max_states = max_states;
+    SolveState first = { .x = in.x, .y = in.y, .parent = -1 };
+    int goal = -1;
+    bool oom = !solve_add(&sv, &first, NULL);
+    if (!oom && in.x == gx && in.y == gy) goal = 0;
+    sv.level_begin = 0; sv.level_end = sv.nstates;
+    if (threads <= 0) threads = cpu_count();
+    while (!oom && goal < 0 && sv.level_begin < sv.level_end && sv.nstates < max_states) {
+        sv.nchunks = (sv.level_end - sv.level_begin + SOLVE_CHUNK - 1) / SOLVE_CHUNK;
+        if (sv.nchunks > sv.ccap) {
+            SolveChunk *nc = realloc(sv.chunks, sv.nchunks * sizeof(SolveChunk));
+            if (!nc) { oom = true; break; }
+            memset(nc + sv.ccap, 0, (sv.nchunks - sv.ccap) * sizeof(SolveChunk));
+            sv.chunks = nc; sv.ccap = sv.nchunks;
+        }
+        for (int k = 0; k < sv.nchunks; k++) { sv.chunks[k].nkids = 0; sv.chunks[k].npool = 0; }
+        atomic_init(&sv.next, 0);
+        atomic_init(&sv.pending, 0);
+        run_workers(solve_worker, &sv, threads < sv.nchunks ? threads : sv.nchunks);
+        // новые состояния добавляются в порядке порций до предела max-states, поэтому ответ не зависит от числа потоков
+        for (int k = 0; k < sv.nchunks && !oom && goal < 0 && sv.nstates < max_states; k++) {
+            SolveChunk *c = &sv.chunks[k];
+            int end = sv.level_begin + (k + 1) * SOLVE_CHUNK;
+            if (end > sv.level_end) end = sv.level_end;
+            for (;;) {
+                if (c->oom) { oom = true; break; }
+                for (int i = 0; i < c->nkids && sv.nstates < max_states; i++) {
+                    SolveKid *kid = &c->kids[i];
+                    const SolveCell *cells = kid->local >= 0 ? c->pool + kid->local : sv.pool + sv.states[kid->st.parent].cells;
+                    if (solve_find(&sv, &kid->st, cells) >= 0) continue;
+                    if (!solve_add(&sv, &kid->st, kid->local >= 0 ? cells : NULL)) { oom = true; break; }
+                    if (kid->st.x == gx && kid->st.y == gy) { goal = sv.nstates - 1; break; }
+                }
+                if (oom || goal >= 0 || sv.nstates >= max_states || c->done >= end) break;
+                // поток остановился раньше, чем набралось max-states: порция дораскрывается здесь по одному состоянию
+                c->nkids = 0; c->npool = 0;
+                solve_expand(&sv, c, c->done++);
+            }
+        }
+        sv.level_begin = sv.level_end; sv.level_end = sv.nstates;
     }
-    if (*history) {
-        for (int k = 0; k < *hsize; k++) {
-            if ((*history)[k].terrain) {
-                for (int i = 0; i < height; i++) { free((*history)[k].terrain[i]); free((*history)[k].paint[i]); }
-                free((*history)[k].terrain); free((*history)[k].paint);
+
+    int rc = 1;
+    if (oom) printf("Error: out of memory\n");
+    else if (goal < 0 && sv.level_begin < sv.level_end) printf("Error: no path found within %lld states\n", max_states);
+    else if (goal < 0) printf("Error: no path to %d %d\n", gx, gy);
+    else {
+        // путь от цели к началу, затем скрипт: исходный текст и команды
+        int n = 0;
+        for (int i = goal; sv.states[i].parent >= 0; i = sv.states[i].parent) n++;
+        int *path = malloc((n + 1) * sizeof(int));
+        FILE *out = path ? fopen(output, "w") : NULL;
+        Source src;
+        if (!path) printf("Error: out of memory\n");
+        else if (!out) printf("Error: cannot open '%s'\n", output);
+        else if (!source_open(&src, input)) printf("Error: cannot open '%s'\n", input);
+        else {
+            char *line;
+            while ((line = source_next(&src))) fprintf(out, "%s\n", line);
+            bool copied = !src.oom;
+            source_close(&src);
+            if (!copied) printf("Error: out of memory\n");
+            int k = n;
+            for (int i = goal; sv.states[i].parent >= 0; i = sv.states[i].parent) path[--k] = i;
+            fprintf(out, "// solve: %d commands to %d %d\n", n, gx, gy);
+            for (k = 0; k < n; k++) {
+                SolveState *s = &sv.states[path[k]];
+                const char *dir = s->dx < 0 ? "LEFT" : s->dx > 0 ? "RIGHT" : s->dy < 0 ? "UP" : "DOWN";
+                if (s->op == OP_JUMP) fprintf(out, "JUMP %s %d\n", dir, s->arg);
+                else fprintf(out, "%s %s\n", s->op == OP_PUSH ? "PUSH" : "MOVE", dir);
             }
+            if (copied) { printf("solved: %d commands, %d states\n", n, sv.nstates); rc = 0; }
         }
-        free(*history); *history = NULL;
+        if (out) fclose(out);
+        free(path);
     }
-    *hsize = 0;
+    solver_free(&sv);
+    cleanup(&in.hist, &in.grid);
+    return rc;
 }
 
+// одно число записи trace; при нехватке данных ставит *ok = false
+unsigned long long trace_num(const unsigned char *p, size_t n, size_t *pos, bool *ok) {
+    unsigned long long v = 0;
+    if (*ok && !get_varint(p, n, pos, &v)) *ok = false;
+    return v;
+}
 
-bool execute_command(char *line, int lnum, char *ctx, char **terrain, char **paint, int *x, int *y, int h, int w, bool display, int interval, int depth, State **history, int *hsize, int *hcap) {
-    size_t len = strlen(line);
-    if (len >= 2 && line[0] == '/' && line[1] == '/') return true;
-    if (len == 0) return true;
-    if (line[0] == ' ') { printf("Error: leading spaces %s line %d\n", ctx, lnum); return false; }
+// восстанавливает поле после шага target (0 — начальное поле, -1 — последний шаг) и сохраняет в output
+int run_replay(const char *tracef, const char *output, long long target, const Options *opt) {
+    Source src; if (!source_open(&src, tracef)) { printf("Error: cannot open '%s'\n", tracef); return 1; }
+    const unsigned char *p = (const unsigned char *)src.data; size_t n = src.size, pos;
+    Grid g = {0}; int x, y;
+    Log quiet = { .buffered = true };
+    if (n < 5 + SNAPSHOT_HEADER || memcmp(p, TRACE_MAGIC, 4) != 0 || p[4] != TRACE_VERSION || memcmp(p + 5, SNAPSHOT_MAGIC, 4) != 0
+        || !grid_init(&g, (int)get_u32(p + 10), (int)get_u32(p + 14))
+        || !load_binary(&g, p + 5, n - 5, &x, &y, &pos, 0, &quiet)) {
+        printf("Error: invalid trace '%s'\n", tracef);
+        log_free(&quiet); grid_free(&g); source_close(&src); return 1;
+    }
+    log_free(&quiet);
+    pos += 5;
 
-    int dx = 0, dy = 0; char dir[10];
-    bool is_undo = (strncmp(line, "UNDO", 4) == 0 && (len == 4 || (line[4] == ' ' && line[5] == '\0')));
-    bool success = true;
-    bool warning_issued = false;
-
-    if (is_undo) {
-        // Проверяем, что после UNDO нет лишних символов
-        if (len > 4 && line[4] != ' ') {
-            printf("Error: unknown command '%s' %s line %d\n", line, ctx, lnum);
-            return false;
-        }
-        pop_state(history, hsize, &terrain, &paint, x, y, h, w);
-    } else if (strncmp(line, "MOVE ", 5) == 0) {
-        if (sscanf(line + 5, "%9s", dir) != 1) {
-            printf("Error: invalid MOVE command syntax %s line %d\n", ctx, lnum);
-            return false;
+    // имена файлов — ссылки в сам trace
+    const unsigned char **names = NULL; int *name_len = NULL, nnames = 0;
+    long long step = 0; int op = -1, file = 0; unsigned long long line = 0;
+    bool ok = true, oom = false, ended = false; // ok — формат в порядке
+    while (ok && !oom && step != target) {
+        if (pos >= n) break;
+        unsigned char tag = p[pos++];
+        if (tag == TRACE_END) { ended = true; break; }
+        if (tag == TRACE_FILE) {
+            unsigned long long id = trace_num(p, n, &pos, &ok), len = trace_num(p, n, &pos, &ok);
+            if (!ok || id != (unsigned long long)nnames + 1 || len > n - pos) { ok = false; break; }
+            const unsigned char **nn = realloc(names, (nnames + 1) * sizeof(*names));
+            int *nl = realloc(name_len, (nnames + 1) * sizeof(int));
+            if (nn) names = nn;
+            if (nl) name_len = nl;
+            if (!nn || !nl) { oom = true; break; }
+            names[nnames] = p + pos; name_len[nnames] = (int)len; nnames++;
+            pos += len;
+            continue;
         }
-        // Проверяем, что после направления нет лишних символов
-        char extra[100];
-        if (sscanf(line + 5 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after MOVE command %s line %d\n", ctx, lnum);
-            return false;
+        if (tag >= OP_COUNT) { ok = false; break; }
+        unsigned long long f = trace_num(p, n, &pos, &ok);
+        line = trace_num(p, n, &pos, &ok);
+        x = wrap(x + unzigzag(trace_num(p, n, &pos, &ok)), g.width);
+        y = wrap(y + unzigzag(trace_num(p, n, &pos, &ok)), g.height);
+        unsigned long long cells = trace_num(p, n, &pos, &ok);
+        if (!ok || f == 0 || f > (unsigned long long)nnames) { ok = false; break; }
+        for (unsigned long long i = 0; ok && i < cells; i++) {
+            int cx = wrap(x + unzigzag(trace_num(p, n, &pos, &ok)), g.width);
+            int cy = wrap(y + unzigzag(trace_num(p, n, &pos, &ok)), g.height);
+            if (!ok || pos + 2 > n) { ok = false; break; }
+            grid_put(&g, cx, cy, (Cell){ (char)p[pos], (char)p[pos + 1] });
+            pos += 2;
         }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
+        if (g.oom) { oom = true; break; }
+        op = tag; file = (int)f; step++;
+    }
+
+    int rc = 0;
+    if (oom) { printf("Error: out of memory\n"); rc = 1; }
+    else if (!ok) { printf("Error: invalid trace '%s' after step %lld\n", tracef, step); rc = 1; }
+    else if (target >= 0 && step < target) {
+        printf("Error: trace has only %lld steps\n", step); rc = 1;
+    } else {
+        if (target < 0 && !ended) printf("Warning: trace is truncated after step %lld\n", step);
+        if (op < 0) printf("step 0: start\n");
+        else printf("step %lld: %.*s line %llu %s\n", step, name_len[file - 1], (const char *)names[file - 1], line, op_names[op]);
+        if (opt->save && !save_field(output, &g, y, x, opt->binary)) printf("Warning: cannot open '%s'\n", output);
+    }
+    free(names); free(name_len);
+    grid_free(&g); source_close(&src);
+    return rc;
+}
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+#else
+typedef pthread_mutex_t Mutex;
+#endif
+
+void mutex_init(Mutex *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+void mutex_unlock(Mutex *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+void mutex_destroy(Mutex *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+// сессия сервера: поле, динозавр, история и кэш EXEC живут между запросами
+typedef struct {
+    char *name;
+    Interp in;
+    Program pending; // команды незакрытого REPEAT
+    bool sized, started;
+    int lnum;        // номер следующей строки сессии (для сообщений)
+    Mutex lock;      // один запрос к сессии за раз
+    int refs;        // сколько соединений выбрали сессию (под замком сервера)
+    bool closed;     // удалена из таблицы, освобождается с последним соединением
+} Session;
+
+// сессии по имени, общие для всех соединений
+typedef struct {
+    Session **sessions; int size, cap;
+    Mutex lock;
+} Server;
+
+// поле, история и кэш EXEC сессии освобождаются, сессия снова ждет SIZE
+void session_reset(Session *s) {
+    exec_cache_free(&s->in.exec_cache);
+    cleanup(&s->in.hist, &s->in.grid);
+    program_free(&s->pending);
+    s->in.x = s->in.y = 0; s->in.executed = 0;
+    s->sized = s->started = false;
+}
+
+// находит или создает сессию и отмечает, что соединение ее использует
+Session *server_attach(Server *srv, const char *name) {
+    mutex_lock(&srv->lock);
+    Session *s = NULL;
+    for (int i = 0; i < srv->size; i++) if (strcmp(srv->sessions[i]->name, name) == 0) { s = srv->sessions[i]; break; }
+    if (!s && srv->size == srv->cap) {
+        int ncap = srv->cap ? srv->cap * 2 : 8;
+        Session **ns = realloc(srv->sessions, ncap * sizeof(Session *));
+        if (ns) { srv->sessions = ns; srv->cap = ncap; }
+    }
+    if (!s && srv->size < srv->cap && (s = calloc(1, sizeof(Session)))) {
+        s->name = malloc(strlen(name) + 1);
+        if (!s->name) { free(s); s = NULL; }
         else {
-            printf("Error: invalid direction '%s' in MOVE command %s line %d\n", dir, ctx, lnum);
-            return false;
+            strcpy(s->name, name);
+            s->in.fuse = true; s->lnum = 1;
+            mutex_init(&s->lock);
+            srv->sessions[srv->size++] = s;
         }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        char target_t = terrain[ny][nx];
-        if (target_t == '%') { printf("Error: stepped on pit\n"); return false; }
-        else if (target_t == '^' || target_t == '&' || target_t == '@') { 
-            printf("Warning: cannot step on obstacle\n"); 
-            warning_issued = true; 
-        }
-        else { *x = nx; *y = ny; }
-    } else if (strncmp(line, "PAINT ", 6) == 0) {
-        char ch; 
-        char extra[100];
-        if (sscanf(line + 6, " %c%99s", &ch, extra) != 1) {
-            printf("Error: invalid PAINT command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (ch < 'a' || ch > 'z') {
-            printf("Error: invalid paint character '%c' (must be a-z) %s line %d\n", ch, ctx, lnum);
-            return false;
-        }
-        paint[*y][*x] = ch;
-    } else if (strncmp(line, "DIG ", 4) == 0) {
-        if (sscanf(line + 4, "%9s", dir) != 1) {
-            printf("Error: invalid DIG command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 4 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after DIG command %s line %d\n", ctx, lnum);
-            return false;
+    }
+    if (s) s->refs++;
+    mutex_unlock(&srv->lock);
+    return s;
+}
+
+// соединение больше не использует сессию; close — удалить ее из таблицы
+void server_detach(Server *srv, Session *s, bool close) {
+    mutex_lock(&srv->lock);
+    if (close && !s->closed) {
+        for (int i = 0; i < srv->size; i++) {
+            if (srv->sessions[i] == s) { srv->sessions[i] = srv->sessions[--srv->size]; break; }
         }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in DIG command %s line %d\n", dir, ctx, lnum);
-            return false;
+        s->closed = true;
+    }
+    bool last = --s->refs == 0 && s->closed;
+    mutex_unlock(&srv->lock);
+    if (!last) return;
+    session_reset(s);
+    mutex_destroy(&s->lock);
+    free(s->name); free(s);
+}
+
+// одна строка запроса к сессии; сообщения — в log, FIELD пишет поле в out. true — ответ ok
+bool session_line(Session *s, char *line, Log *log, FILE *out) {
+    Interp *in = &s->in;
+    int lnum = s->lnum++;
+    in->log = log;
+    if (strncmp(line, "SIZE ", 5) == 0) {
+        int w, h; char extra[2];
+        if (sscanf(line + 5, "%d %d %1s", &w, &h, extra) != 2 || w < 10 || w > MAX_SIZE || h < 10 || h > MAX_SIZE) {
+            log_msg(log, "Error: invalid SIZE (10-%d) at line %d\n", MAX_SIZE, lnum); return false;
         }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] == '^') {
-            terrain[ny][nx] = '_';
+        session_reset(s);
+        if (!grid_init(&in->grid, w, h)) { log_msg(log, "Error: out of memory\n"); cleanup(&in->hist, &in->grid); return false; }
+        s->sized = true;
+        return true;
+    }
+    if (!s->sized) { log_msg(log, "Error: first non-comment must be SIZE at line %d\n", lnum); return false; }
+    if (strncmp(line, "START ", 6) == 0 || strncmp(line, "LOAD ", 5) == 0) {
+        if (s->started) { log_msg(log, "Error: repeated %s at line %d\n", line[0] == 'S' ? "START" : "LOAD", lnum); return false; }
+        int x, y;
+        if (line[0] == 'S') {
+            if (sscanf(line + 6, "%d %d", &x, &y) != 2 || x < 0 || x >= in->grid.width || y < 0 || y >= in->grid.height) {
+                log_msg(log, "Error: invalid START at line %d\n", lnum); return false;
+            }
         } else {
-            terrain[ny][nx] = '%';
-        }
-    } else if (strncmp(line, "MOUND ", 6) == 0) {
-        if (sscanf(line + 6, "%9s", dir) != 1) {
-            printf("Error: invalid MOUND command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 6 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after MOUND command %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in MOUND command %s line %d\n", dir, ctx, lnum);
-            return false;
-        }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] == '%') terrain[ny][nx] = '_'; 
-        else terrain[ny][nx] = '^';
-    } else if (strncmp(line, "JUMP ", 5) == 0) {
-        int n; 
-        char extra[100];
-        if (sscanf(line + 5, "%9s %d%99s", dir, &n, extra) != 2) {
-            printf("Error: invalid JUMP command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (n < 0) {
-            printf("Error: negative jump distance %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in JUMP command %s line %d\n", dir, ctx, lnum);
-            return false;
-        }
-        if (n == 0) return true;
-        int curr_x = *x, curr_y = *y;
-        bool stop_before_mound = false;
-        bool ignore_jump = false;
-        for (int step = 1; step <= n; step++) {
-            int nx = (curr_x + dx + w) % w; int ny = (curr_y + dy + h) % h;
-            char next_t = terrain[ny][nx];
-            if (next_t == '^') {
-                printf("Warning: cannot jump over mound\n");
-                stop_before_mound = true;
-                warning_issued = true;
-                break;
-            } else if (next_t == '&' || next_t == '@') {
-                printf("Warning: cannot jump over obstacle\n");
-                ignore_jump = true;
-                warning_issued = true;
-                break;
+            // неудачный LOAD мог частично заполнить поле — начинаем с чистого
+            int w = in->grid.width, h = in->grid.height;
+            if (!load_line(&in->grid, line, &x, &y, lnum, log)) {
+                grid_free(&in->grid);
+                if (!grid_init(&in->grid, w, h)) { log_msg(log, "Error: out of memory\n"); s->sized = false; }
+                return false;
             }
-            curr_x = nx; curr_y = ny;
-        }
-        if (!ignore_jump) {
-            char final_t = terrain[curr_y][curr_x];
-            if (final_t == '%') { printf("Error: stepped on pit\n"); return false; }
-            *x = curr_x; *y = curr_y;
-        }
-    } else if (strncmp(line, "GROW ", 5) == 0) {
-        if (sscanf(line + 5, "%9s", dir) != 1) {
-            printf("Error: invalid GROW command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 5 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after GROW command %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in GROW command %s line %d\n", dir, ctx, lnum);
-            return false;
-        }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] != '_') { 
-            printf("Error: cannot grow tree on non-empty cell %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        terrain[ny][nx] = '&';
-    } else if (strncmp(line, "CUT ", 4) == 0) {
-        if (sscanf(line + 4, "%9s", dir) != 1) {
-            printf("Error: invalid CUT command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 4 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after CUT command %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in CUT command %s line %d\n", dir, ctx, lnum);
-            return false;
-        }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] != '&') { 
-            printf("Error: no tree to cut %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        terrain[ny][nx] = '_';
-    } else if (strncmp(line, "MAKE ", 5) == 0) {
-        if (sscanf(line + 5, "%9s", dir) != 1) {
-            printf("Error: invalid MAKE command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 5 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after MAKE command %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in MAKE command %s line %d\n", dir, ctx, lnum);
-            return false;
-        }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] != '_') { 
-            printf("Error: cannot make stone on non-empty cell %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        terrain[ny][nx] = '@';
-    } else if (strncmp(line, "PUSH ", 5) == 0) {
-        if (sscanf(line + 5, "%9s", dir) != 1) {
-            printf("Error: invalid PUSH command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        char extra[100];
-        if (sscanf(line + 5 + strlen(dir), "%99s", extra) == 1) {
-            printf("Error: extra characters after PUSH command %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (strcmp(dir, "UP") == 0) dy = -1; 
-        else if (strcmp(dir, "DOWN") == 0) dy = 1;
-        else if (strcmp(dir, "LEFT") == 0) dx = -1; 
-        else if (strcmp(dir, "RIGHT") == 0) dx = 1; 
-        else {
-            printf("Error: invalid direction '%s' in PUSH command %s line %d\n", dir, ctx, lnum);
-            return false;
         }
-        int nx = (*x + dx + w) % w; int ny = (*y + dy + h) % h;
-        if (terrain[ny][nx] != '@') { 
-            printf("Error: no stone to push %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        int px = (nx + dx + w) % w; int py = (ny + dy + h) % h;
-        char tt = terrain[py][px];
-        if (tt == '^' || tt == '&' || tt == '@') { 
-            printf("Error: cannot push stone into obstacle %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        terrain[ny][nx] = '_';
-        if (tt == '%') terrain[py][px] = '_'; 
-        else terrain[py][px] = '@';
-        *x = nx;
-        *y = ny;
-    } else if (strncmp(line, "EXEC ", 5) == 0) {
-        char fname[50]; 
-        char extra[100];
-        if (sscanf(line + 5, "%49s%99s", fname, extra) != 1) {
-            printf("Error: invalid EXEC command syntax %s line %d\n", ctx, lnum);
-            return false;
-        }
-        if (depth >= 10) { 
-            printf("Error: nesting too deep %s line %d\n", ctx, lnum); 
-            return false; 
-        }
-        FILE *subfp = fopen(fname, "r"); 
-        if (!subfp) { 
-            printf("Error: cannot open exec file '%s' %s line %d\n", fname, ctx, lnum); 
-            return false; 
-        }
-        char subline[100]; int subln = 0;
-        while (fgets(subline, sizeof(subline), subfp)) {
-            subln++; 
-            size_t slen = strlen(subline); 
-            if (slen > 0 && subline[slen - 1] == '\n') subline[slen - 1] = '\0';
-            if (slen == 0 || (slen >= 2 && subline[0] == '/' && subline[1] == '/')) continue;
-            if (subline[0] == ' ') { 
-                printf("Error: leading spaces in %s line %d\n", fname, subln); 
-                fclose(subfp); 
-                return false; 
-            }
-            if (!execute_command(subline, subln, fname, terrain, paint, x, y, h, w, display, interval, depth + 1, history, hsize, hcap)) { 
-                fclose(subfp); 
-                return false; 
+        in->x = x; in->y = y;
+        s->started = true;
+        push_state(&in->hist, x, y);
+        return true;
+    }
+    if (!s->started) { log_msg(log, "Error: LOAD/START expected at line %d\n", lnum); return false; }
+    if (strcmp(line, "FIELD") == 0) {
+        if (!print_field(out, &in->grid, in->y, in->x)) { log_msg(log, "Error: out of memory\n"); return false; }
+        return true;
+    }
+    if (strcmp(line, "POS") == 0) {
+        log_msg(log, "%d %d\n", in->x, in->y);
+        return true;
+    }
+    if (strncmp(line, "SAVE ", 5) == 0) {
+        int end;
+        char *fname = token_dup(line + 5, &end), mode[16] = "";
+        if (!fname) { log_msg(log, "Error: out of memory\n"); return false; }
+        int n = fname[0] != '\0' ? 1 + (sscanf(line + 5 + end, "%15s", mode) == 1) : 0;
+        bool ok = n >= 1 && (n == 1 || strcmp(mode, "binary") == 0);
+        if (!ok) log_msg(log, "Error: invalid SAVE at line %d\n", lnum);
+        else if (!save_field(fname, &in->grid, in->y, in->x, n == 2)) { log_msg(log, "Error: cannot open '%s'\n", fname); ok = false; }
+        free(fname);
+        return ok;
+    }
+
+    // команда MovDino; строки REPEAT копятся до закрывающего END
+    if (!s->pending.ctx) program_init(&s->pending, s->name, log);
+    s->pending.log = log;
+    bool ok = compile_line(&s->pending, line, lnum);
+    if (ok && s->pending.nblocks > 0) return true;
+    if (ok) ok = program_finish(&s->pending);
+    if (ok) ok = run_program(in, &s->pending, 0, s->pending.size, 0);
+    program_free(&s->pending);
+    return ok;
+}
+
+// обслуживает одно соединение (или stdin/stdout): строка запроса — ответ из сообщений и ok/error
+void serve_conn(Server *srv, FILE *in, FILE *out) {
+    Session *s = NULL;
+    char *line = NULL; size_t cap = 0;
+    Log log = { .buffered = true };
+    for (;;) {
+        // строки любой длины: читаем кусками в растущий буфер
+        size_t len = 0;
+        for (;;) {
+            if (cap - len < 2) {
+                size_t ncap = cap ? cap * 2 : 256;
+                char *nl = realloc(line, ncap);
+                if (!nl) break;
+                line = nl; cap = ncap;
             }
+            if (!fgets(line + len, (int)(cap - len), in)) break;
+            len += strlen(line + len);
+            if (line[len - 1] == '\n') break;
         }
-        fclose(subfp);
-    } else if (strncmp(line, "IF CELL ", 8) == 0) {
-        int cx, cy; char isym; char then_cmd[90];
-        char extra[100];
-        // Более строгая проверка синтаксиса IF CELL
-        if (sscanf(line, "IF CELL %d %d IS %c THEN %89[^\n]%99s", &cx, &cy, &isym, then_cmd, extra) != 4) {
-            printf("Error: invalid IF CELL command syntax %s line %d\n", ctx, lnum);
-            return false;
+        if (len == 0) break;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+        bool ok = true, quit = false;
+        if (strcmp(line, "QUIT") == 0) quit = true;
+        else if (strncmp(line, "SESSION ", 8) == 0 && line[8] != '\0' && !strchr(line + 8, ' ')) {
+            Session *ns = server_attach(srv, line + 8);
+            if (!ns) { log_msg(&log, "Error: out of memory\n"); ok = false; }
+            else { if (s) server_detach(srv, s, false); s = ns; }
         }
-        cx = (cx % w + w) % w; cy = (cy % h + h) % h;
-        char cell_sym = (cx == *x && cy == *y) ? '#' : (terrain[cy][cx] == '_' && paint[cy][cx] >= 'a' && paint[cy][cx] <= 'z' ? paint[cy][cx] : terrain[cy][cx]);
-        if (cell_sym == isym) {
-            return execute_command(then_cmd, lnum, ctx, terrain, paint, x, y, h, w, display, interval, depth + 1, history, hsize, hcap);
+        else if (line[0] == '\0' || (line[0] == '/' && line[1] == '/')) {}
+        else if (!s) { log_msg(&log, "Error: no session, send SESSION <name>\n"); ok = false; }
+        else if (strcmp(line, "CLOSE") == 0) { server_detach(srv, s, true); s = NULL; }
+        else {
+            mutex_lock(&s->lock);
+            ok = session_line(s, line, &log, out);
+            mutex_unlock(&s->lock);
         }
-    } else {
-        // Любая другая строка, которая не соответствует ни одному известному формату команды
-        printf("Error: unknown command '%s' %s line %d\n", line, ctx, lnum);
-        return false;
-    }
-
-    if (success && !is_undo) push_state(history, hsize, hcap, terrain, paint, *x, *y, h, w);
-    
-    if (success && !warning_issued && display && interval > 0) { 
-        clear_screen(); 
-        print_field(stdout, terrain, paint, *y, *x, h, w, false); 
-        sleep(interval); 
+        if (log.size > 0) fwrite(log.buf, 1, log.size, out);
+        log.size = 0;
+        fprintf(out, ok ? "ok\n" : "error\n");
+        // клиент отключился, не дочитав ответ: соединение закрывается, сессия остается
+        if (fflush(out) != 0 || ferror(out)) break;
+        if (quit) break;
     }
-    
-    return true;
+    if (s) server_detach(srv, s, false);
+    log_free(&log); free(line);
 }
-int main(int argc, char *argv[]) {
-    if (argc < 3) { printf("Usage: %s <input.txt> <output.txt> [interval N] [no-display] [no-save]\n", argv[0]); return 1; }
-
-    bool display = true, save = true; int interval = 1;
-    for (int i = 3; i < argc; i++) {
-        if (strcmp(argv[i], "no-display") == 0) display = false;
-        else if (strcmp(argv[i], "no-save") == 0) save = false;
-        else if (strcmp(argv[i], "interval") == 0) { i++; if (i >= argc) { printf("Error: missing N for interval\n"); return 1; } interval = atoi(argv[i]); if (interval < 0) interval = 0; }
-        else { printf("Error: unknown option '%s'\n", argv[i]); return 1; }
-    }
 
-    FILE *fp = fopen(argv[1], "r"); if (!fp) { printf("Error: cannot open '%s'\n", argv[1]); return 1; }
+#ifndef _WIN32
+typedef struct {
+    Server *srv;
+    int fd;
+} ConnArg;
 
-    char **terrain = NULL, **paint = NULL; int width = 0, height = 0, x = 0, y = 0;
-    bool size_set = false, start_set = false; int line_num = 0; char line[100]; char ctx[100]; strcpy(ctx, argv[1]);
-    State *history = NULL; int hsize = 0, hcap = 0;
+void *conn_worker(void *arg) {
+    ConnArg *c = arg;
+    FILE *in = fdopen(c->fd, "r");
+    int wfd = dup(c->fd);
+    FILE *out = wfd >= 0 ? fdopen(wfd, "w") : NULL;
+    if (in && out) serve_conn(c->srv, in, out);
+    if (in) fclose(in); else close(c->fd);
+    if (out) fclose(out); else if (wfd >= 0) close(wfd);
+    free(c);
+    return NULL;
+}
+#endif
 
-    while (fgets(line, sizeof(line), fp)) {
-        line_num++; size_t len = strlen(line); if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
-        if (len == 0) continue; if (len >= 2 && line[0] == '/' && line[1] == '/') continue;
-        if (line[0] == ' ') { printf("Error: leading spaces at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
+// режим сервера: сессии живут в памяти процесса, запросы приходят по Unix-сокету
+// (каждое соединение в своем потоке) или, если путь "-", построчно из stdin
+int run_server(const char *path) {
+    Server srv = {0};
+    mutex_init(&srv.lock);
+    if (strcmp(path, "-") == 0) {
+        serve_conn(&srv, stdin, stdout);
+        for (int i = srv.size - 1; i >= 0; i--) {
+            Session *s = srv.sessions[i];
+            s->refs++;
+            server_detach(&srv, s, true);
+        }
+        free(srv.sessions);
+        mutex_destroy(&srv.lock);
+        return 0;
+    }
+#ifdef _WIN32
+    printf("Error: only 'serve -' is supported on Windows\n");
+    return 1;
+#else
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { printf("Error: socket path too long\n"); return 1; }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); // сокет от прошлого запуска
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        printf("Error: cannot listen on '%s'\n", path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    // запись в закрытое клиентом соединение не должна убивать процесс со всеми сессиями
+    signal(SIGPIPE, SIG_IGN);
+    printf("listening on %s\n", path);
+    fflush(stdout);
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // кончились дескрипторы или память: ждем, пока закроются другие соединения
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) { sleep_ms(100); continue; }
+            printf("Error: accept failed on '%s'\n", path);
+            close(fd);
+            return 1;
+        }
+        ConnArg *c = malloc(sizeof(ConnArg));
+        pthread_t tid;
+        if (!c) { close(cfd); continue; }
+        c->srv = &srv; c->fd = cfd;
+        if (pthread_create(&tid, NULL, conn_worker, c) != 0) { close(cfd); free(c); continue; }
+        pthread_detach(tid);
+    }
+#endif
+}
 
-        if (!size_set) {
-            if (strncmp(line, "SIZE ", 5) != 0) { printf("Error: first non-comment must be SIZE at line %d\n", line_num); fclose(fp); return 1; }
-            if (sscanf(line + 5, "%d %d", &width, &height) != 2 || width < 10 || width > 100 || height < 10 || height > 100) {
-                printf("Error: invalid SIZE (10-100) at line %d\n", line_num); fclose(fp); return 1;
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <input.txt> <output.txt> [interval N|Nms] [no-display] [no-save] [check] [binary] [bench] [profile report.json] [trace run.trace]\n", argv[0]);
+        printf("       %s batch <manifest.txt> [threads N] [no-save] [check] [binary]\n", argv[0]);
+        printf("       %s replay <trace> <output.txt> [step N] [no-save] [binary]\n", argv[0]);
+        printf("       %s ensemble <script.txt> <boards.txt> [no-save] [check] [binary] [bench]\n", argv[0]);
+        printf("       %s solve <input.txt> <output.txt> goal X Y [threads N] [max-states N]\n", argv[0]);
+        printf("       %s serve <socket|->\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "solve") == 0) {
+        int gx = -1, gy = -1, threads = 0; long long max_states = 1000000; bool goal = false;
+        if (argc < 4) { printf("Error: missing output for solve\n"); return 1; }
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "goal") == 0) {
+                if (i + 2 >= argc) { printf("Error: missing X Y for goal\n"); return 1; }
+                gx = atoi(argv[i + 1]); gy = atoi(argv[i + 2]); goal = true; i += 2;
             }
-            size_set = true;
-            terrain = malloc(height * sizeof(char *)); if (!terrain) { fclose(fp); return 1; }
-            paint = malloc(height * sizeof(char *)); if (!paint) { free(terrain); fclose(fp); return 1; }
-            for (int i = 0; i < height; i++) {
-                terrain[i] = malloc(width); if (!terrain[i]) { /* cleanup */ fclose(fp); return 1; }
-                memset(terrain[i], '_', width);
-                paint[i] = malloc(width); if (!paint[i]) return 1;
-                memset(paint[i], 0, width);
+            else if (strcmp(argv[i], "threads") == 0) { i++; if (i >= argc) { printf("Error: missing N for threads\n"); return 1; } threads = atoi(argv[i]); }
+            else if (strcmp(argv[i], "max-states") == 0) {
+                i++; if (i >= argc) { printf("Error: missing N for max-states\n"); return 1; }
+                max_states = atoll(argv[i]); if (max_states < 1 || max_states > (1 << 30)) { printf("Error: invalid max-states '%s'\n", argv[i]); return 1; }
             }
-            continue;
+            else { printf("Error: unknown option '%s'\n", argv[i]); return 1; }
         }
+        if (!goal) { printf("Error: missing goal for solve\n"); return 1; }
+        return run_solve(argv[2], argv[3], gx, gy, threads, max_states);
+    }
+    if (strcmp(argv[1], "serve") == 0) {
+        if (argc > 3) { printf("Error: unknown option '%s'\n", argv[3]); return 1; }
+        return run_server(argv[2]);
+    }
 
-        if (!start_set) {
-            bool handled = false;
-            if (strncmp(line, "LOAD ", 5) == 0) {
-                char lfname[50]; if (sscanf(line + 5, "%s", lfname) != 1) { printf("Error: invalid LOAD at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-                FILE *loadf = fopen(lfname, "r"); if (!loadf) { printf("Error: cannot open '%s' at line %d\n", lfname, line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-                char row[201]; bool found_dino = false;
-                for (int i = 0; i < height; i++) {
-                    if (!fgets(row, sizeof(row), loadf)) { printf("Error: incomplete LOAD at line %d\n", line_num); fclose(loadf); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-                    char *p = row; for (int j = 0; j < width; j++) {
-                        char c; if (sscanf(p, "%c", &c) != 1 || *(p + 1) != ' ') { printf("Error: invalid LOAD format at line %d\n", line_num); fclose(loadf); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-                        p += 2; if (c == '#') { x = j; y = i; terrain[i][j] = '_'; paint[i][j] = '\0'; found_dino = true; }
-                        else if (c >= 'a' && c <= 'z') { terrain[i][j] = '_'; paint[i][j] = c; } else { terrain[i][j] = c; paint[i][j] = '\0'; }
-                    }
-                }
-                fclose(loadf); if (!found_dino) { printf("Error: no # in LOAD at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-                start_set = true; handled = true; if (display) { clear_screen(); print_field(stdout, terrain, paint, y, x, height, width, false); }
-            } else if (strncmp(line, "START ", 6) == 0) {
-                if (sscanf(line + 6, "%d %d", &x, &y) != 2 || x < 0 || x >= width || y < 0 || y >= height) {
-                    printf("Error: invalid START at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1;
-                }
-                start_set = true; handled = true; if (display) { clear_screen(); print_field(stdout, terrain, paint, y, x, height, width, false); }
-            }
-            if (handled) push_state(&history, &hsize, &hcap, terrain, paint, x, y, height, width);
-            if (!handled) { printf("Error: LOAD/START expected at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-            continue;
+    bool batch = strcmp(argv[1], "batch") == 0, replay = strcmp(argv[1], "replay") == 0, ensemble = strcmp(argv[1], "ensemble") == 0;
+    int threads = 0; long long step = -1;
+    if ((replay || ensemble) && argc < 4) { printf("Error: missing %s for %s\n", replay ? "output" : "boards", argv[1]); return 1; }
+    Options opt = { .display = !batch && !replay && !ensemble, .save = true, .check = false, .interval_ms = 1000 };
+    for (int i = replay || ensemble ? 4 : 3; i < argc; i++) {
+        if (strcmp(argv[i], "no-display") == 0) opt.display = false;
+        else if (strcmp(argv[i], "no-save") == 0) opt.save = false;
+        else if (strcmp(argv[i], "check") == 0) opt.check = true;
+        else if (strcmp(argv[i], "binary") == 0) opt.binary = true;
+        else if (strcmp(argv[i], "bench") == 0) opt.bench = true;
+        else if (!replay && strcmp(argv[i], "memo") == 0) opt.memo = true;
+        else if (strcmp(argv[i], "interval") == 0) {
+            i++; if (i >= argc) { printf("Error: missing N for interval\n"); return 1; }
+            // N — секунды, Nms — миллисекунды
+            char *end; long v = strtol(argv[i], &end, 10);
+            opt.interval_ms = strcmp(end, "ms") == 0 ? (int)v : (int)v * 1000; if (opt.interval_ms < 0) opt.interval_ms = 0;
         }
-
-        if (strncmp(line, "SIZE ", 5) == 0 || strncmp(line, "START ", 6) == 0) { printf("Error: repeated %s at line %d\n", strncmp(line, "SIZE ", 5) == 0 ? "SIZE" : "START", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-        if (strncmp(line, "LOAD ", 5) == 0) { printf("Error: LOAD must be first at line %d\n", line_num); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-
-        if (!execute_command(line, line_num, ctx, terrain, paint, &x, &y, height, width, display, interval, 0, &history, &hsize, &hcap)) {
-            cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1;
+        else if (!batch && !replay && !ensemble && strcmp(argv[i], "profile") == 0) { i++; if (i >= argc) { printf("Error: missing file for profile\n"); return 1; } opt.profile = argv[i]; }
+        else if (!batch && !replay && !ensemble && strcmp(argv[i], "trace") == 0) { i++; if (i >= argc) { printf("Error: missing file for trace\n"); return 1; } opt.trace = argv[i]; }
+        else if (replay && strcmp(argv[i], "step") == 0) {
+            i++; if (i >= argc) { printf("Error: missing N for step\n"); return 1; }
+            step = atoll(argv[i]); if (step < 0) { printf("Error: invalid step '%s'\n", argv[i]); return 1; }
         }
+        else if (batch && strcmp(argv[i], "threads") == 0) { i++; if (i >= argc) { printf("Error: missing N for threads\n"); return 1; } threads = atoi(argv[i]); }
+        else { printf("Error: unknown option '%s'\n", argv[i]); return 1; }
     }
+    if (batch) { opt.display = false; return run_batch(argv[2], threads, &opt); }
+    if (replay) return run_replay(argv[2], argv[3], step, &opt);
+    if (ensemble) return run_ensemble(argv[2], argv[3], &opt);
 
-    if (!size_set) { printf("Error: no SIZE\n"); fclose(fp); return 1; }
-    if (!start_set) { printf("Error: no START/LOAD\n"); cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp); return 1; }
-
-    if (save) {
-        FILE *outf = fopen(argv[2], "w"); if (outf) { print_field(outf, terrain, paint, y, x, height, width, true); fclose(outf); } else printf("Warning: cannot open '%s'\n", argv[2]);
-    }
-
-    cleanup(&history, &hsize, &terrain, &paint, height); fclose(fp);
-    return 0;
-}
\ No newline at end of file
+    Log log = {0};
+    return run_job(argv[1], argv[2], &opt, &log);
+}